@@ -9,6 +9,11 @@
  * endpoint and reads the response from the interrupt endpoint, then
  * exposes the battery level via the power_supply subsystem.
  *
+ * When the mouse is reachable both through its receiver and over its
+ * charging cable, and both report the same USB serial number, the two
+ * connections share a single power supply that reports CHARGING and is
+ * queried over the faster of the two links.
+ *
  * Supported devices:
  *   - Keychron M5 (wired mode): 3434:d048
  *   - Keychron M5 (wireless via Ultra-Link 8K receiver): 3434:d028
@@ -16,54 +21,359 @@
 
 #include <linux/module.h>
 #include <linux/hid.h>
+#include <linux/hidraw.h>
+#include <linux/input.h>
 #include <linux/usb.h>
 #include <linux/power_supply.h>
 #include <linux/workqueue.h>
 #include <linux/completion.h>
 #include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/version.h>
+#include <linux/ctype.h>
+#include <linux/random.h>
+#include <linux/semaphore.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/fault-inject.h>
+
+#include "keychron_protocol.h"
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0)
+#define get_random_u32_below(ceil)	prandom_u32_max(ceil)
+#endif
 
 #define USB_VENDOR_ID_KEYCHRON		0x3434
 #define USB_DEVICE_ID_KEYCHRON_M5	0xd048
 #define USB_DEVICE_ID_KEYCHRON_RECV	0xd028
 
-#define KEYCHRON_REPORT_ID_CMD		0xB3
-#define KEYCHRON_REPORT_ID_RESP		0xB4
-#define KEYCHRON_CMD_STATUS		0x06
-#define KEYCHRON_BATTERY_OFFSET		20
 #define KEYCHRON_VENDOR_INTERFACE	4
 
 #define KEYCHRON_POLL_INTERVAL_MS	300000	/* 5 minutes */
 #define KEYCHRON_USB_TIMEOUT_MS		1000
 #define KEYCHRON_RESPONSE_TIMEOUT_MS	500
-#define KEYCHRON_REPORT_SIZE		64
 #define KEYCHRON_QUERY_RETRIES		3
 #define KEYCHRON_RETRY_DELAY_MS		100
+#define KEYCHRON_RTT_UNREACHABLE_US	S32_MAX
+
+#define KEYCHRON_MAX_INFLIGHT		2
+
+#define KEYCHRON_FAST_REPORTS_MAX	4
+#define KEYCHRON_FAST_USAGES_MAX	32
+#define KEYCHRON_COALESCE_MAX_US	8000	/* 125 Hz */
+
+#define KEYCHRON_URB_QUEUE_MAX		8
+
+#define KEYCHRON_HIST_BUCKETS		16	/* log2(us) report intervals */
+#define KEYCHRON_IDLE_INTERVALS		8	/* longer gaps are idle, not drops */
+#define KEYCHRON_RTT_BUCKETS		20	/* log2(us) query round trips */
+
+#define KEYCHRON_CACHE_SIZE		8
+#define KEYCHRON_CACHE_MAX_AGE_MS	3600000	/* 1 hour */
+
+#define KEYCHRON_SLEEP_TIMEOUT_MIN_S	10
+#define KEYCHRON_SLEEP_TIMEOUT_MAX_S	3600
+#define KEYCHRON_SLEEP_GUARD_MS		2000	/* margin for a query to finish */
+#define KEYCHRON_SLEEP_RECHECK_MS	10000
+#define KEYCHRON_HIDRAW_RECHECK_MS	2000
 
 /*
- * Global state for ensuring only one battery instance exists.
- * Multiple HID interfaces probe for the same physical device.
+ * The same mouse can be reachable over two transports at once: through the
+ * Ultra-Link receiver (d028) and, while charging, over its own USB cable
+ * (d048). Each transport is a link, and both links feed one battery when
+ * they can be told apart from a different mouse (see keychron_find_battery).
  */
-static struct keychron_device *keychron_battery_owner;
-static DEFINE_MUTEX(keychron_battery_mutex);
+enum keychron_link_type {
+	KEYCHRON_LINK_WIRELESS,
+	KEYCHRON_LINK_WIRED,
+	KEYCHRON_LINK_COUNT,
+};
 
-struct keychron_device {
+struct keychron_battery;
+struct keychron_cmd;
+
+/*
+ * Input activity of one USB device, shared by its mouse interfaces, which
+ * stamp it on every report, and its vendor link, which reads it to tell
+ * whether the mouse is still awake. @udev only identifies the device.
+ */
+struct keychron_activity {
+	struct list_head node;
+	struct usb_device *udev;
+	unsigned int users;
+	unsigned long last_input;	/* jiffies */
+};
+
+typedef void (*keychron_cmd_done_t)(struct keychron_cmd *cmd, int status);
+
+/*
+ * A vendor command. @id goes out as data[1] of a 0xB3 feature report and
+ * the 0xB4 response is matched by its echo in the same position. @done
+ * is called from the command engine once the response arrived (status is
+ * the response length) or the command failed (negative errno).
+ */
+struct keychron_cmd {
+	struct list_head node;
+	u8 id;
+	u8 payload[KEYCHRON_REPORT_SIZE - 2];
+	u8 resp[KEYCHRON_REPORT_SIZE];
+	int resp_len;
+	unsigned int timeout_ms;
+	keychron_cmd_done_t done;
+	void *context;
+	int status;
+};
+
+/*
+ * Battery query statistics of a link, exposed in debugfs. A query is one
+ * keychron_query_battery() call, made of up to KEYCHRON_QUERY_RETRIES
+ * attempts. Bucket n of @rtt_hist counts answered attempts with a round
+ * trip of [2^(n-1), 2^n) us.
+ */
+struct keychron_query_stats {
+	spinlock_t lock;
+	u64 queries;
+	u64 failed;
+	u64 attempts;
+	u64 timeouts;
+	u64 rtt_hist[KEYCHRON_RTT_BUCKETS];
+	s64 probe_us;		/* probe to battery registration */
+};
+
+#ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
+/*
+ * Injected query failures, each configured through its own fault-inject
+ * debugfs directory: a failed SET_REPORT, a lost response, a response
+ * held back for up to twice its timeout, and a garbled interrupt report.
+ */
+struct keychron_faults {
+	struct fault_attr ctrl_error;
+	struct fault_attr drop_response;
+	struct fault_attr delay_response;
+	struct fault_attr corrupt_response;
+};
+
+#define keychron_fault(link, name)	should_fail(&(link)->faults.name, 1)
+#else
+#define keychron_fault(link, name)	false
+#endif
+
+/*
+ * Query transport state, one per vendor interface that carries the
+ * 0xB3/0xB4 protocol. Commands are queued on @cmd_queue and put on the
+ * wire one at a time by @cmd_work; @cmd_active is the one in flight.
+ * Once @cmd_dead is set both URBs are poisoned and every wait is cut
+ * short, so a disconnect never sits out a query.
+ */
+struct keychron_link {
+	struct keychron_battery *kbat;
 	struct hid_device *hdev;
 	struct usb_device *udev;
 	struct usb_interface *intf;
-	struct power_supply *battery;
-	struct power_supply_desc battery_desc;
-	struct delayed_work battery_work;
 	struct urb *intr_urb;
+	struct urb *ctrl_urb;
+	struct usb_ctrlrequest *ctrl_req;
 	struct completion response_received;
+	struct completion ctrl_done;
+	wait_queue_head_t abort_wait;
 	u8 *intr_buf;
+	u8 *cmd_buf;
 	int intr_ep;
 	int intr_interval;
-	int battery_capacity;
-	int pending_battery;
-	bool owns_battery;
 	atomic_t waiting_response;
+	spinlock_t cmd_lock;
+	struct list_head cmd_queue;
+	struct keychron_cmd *cmd_active;
+	struct work_struct cmd_work;
+	bool cmd_dead;
+	enum keychron_link_type type;
+	s64 rtt_us;		/* smoothed round-trip time, 0 until measured */
+	bool hidraw_paused;	/* queries held off for a hidraw user */
+	struct keychron_activity *activity;
+	struct keychron_query_stats stats;
+#ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
+	struct keychron_faults faults;
+#endif
+};
+
+/*
+ * Battery state, shared by every link to the same mouse. @lock protects
+ * @links and the published state, but isn't held across a query, which
+ * can take seconds: @busy_link is the link being queried meanwhile, and
+ * detach waits on @idle_wait until it is no longer its own.
+ */
+struct keychron_battery {
+	struct list_head node;
+	struct keychron_link *links[KEYCHRON_LINK_COUNT];
+	struct mutex lock;
+	struct keychron_link *busy_link;
+	wait_queue_head_t idle_wait;
+	char *name;
+	struct power_supply *battery;
+	struct power_supply_desc battery_desc;
+	struct delayed_work battery_work;
+	int battery_capacity;
+	bool capacity_cached;	/* published from the cache, not yet queried */
+	unsigned int sleep_timeout_s;	/* mouse idle-to-sleep time, 0 if unknown */
+};
+
+/*
+ * One field value of a fast-path input report: where it sits in the
+ * report and the input event hid-input mapped it to.
+ */
+struct keychron_fast_usage {
+	struct hid_usage *usage;
+	u16 offset;
+	u8 size;
+	bool is_signed;
+	bool ranged;		/* absolute value, drop if out of range */
+	s32 logical_minimum;
+	s32 logical_maximum;
+	s32 pending;		/* coalesced relative value not yet sent */
+};
+
+/* Decoder for one input report that needs nothing but EV_KEY/EV_REL */
+struct keychron_fast_report {
+	struct hid_report *report;
+	struct input_dev *input;
+	unsigned int len;	/* bytes after the report ID */
+	unsigned int num_usages;
+	struct keychron_fast_usage usages[];
+};
+
+/*
+ * Input state of a mouse interface with at least one fast-path report.
+ * With @coalesce_us set, relative deltas are summed and sent as one frame
+ * at most every @coalesce_us; @pending is the report holding unsent
+ * deltas and @flush_timer sends them once the mouse stops moving.
+ */
+struct keychron_input {
+	struct keychron_fast_report *reports[KEYCHRON_FAST_REPORTS_MAX];
+	unsigned int num_reports;
+	spinlock_t lock;
+	struct hrtimer flush_timer;
+	struct keychron_fast_report *pending;
+	ktime_t pending_time;	/* arrival of the last report merged */
+	ktime_t last_flush;
+	unsigned int coalesce_us;
+	bool stopped;
+};
+
+/*
+ * Input report interval statistics, exposed in debugfs. Bucket n of @hist
+ * counts intervals of [2^(n-1), 2^n) us, bucket 0 those under 1 us. Gaps
+ * of a few polling intervals during motion are counted as dropped
+ * reports; longer ones are the mouse going idle.
+ */
+struct keychron_interval_stats {
+	spinlock_t lock;
+	ktime_t last;
+	u64 reports;
+	u64 hist[KEYCHRON_HIST_BUCKETS];
+	u64 dropped;
+	s64 max_gap_us;
+	unsigned int expected_us;	/* endpoint polling interval */
+};
+
+/*
+ * Extra interrupt-IN URBs kept in flight on an input interface alongside
+ * usbhid's own one, so a late completion doesn't leave the endpoint
+ * without a pending transfer at 125 us polling.
+ */
+struct keychron_urb_queue {
+	struct usb_anchor anchor;
+	struct urb *urbs[KEYCHRON_URB_QUEUE_MAX];
+	unsigned int count;
+	unsigned int len;
+	bool running;
+	atomic_t stopped;	/* URBs retired by endpoint errors */
+};
+
+/*
+ * Per-interface state. Every HID interface of the mouse probes, but only
+ * the vendor interface feeding the battery has @link set, only mouse
+ * interfaces with plain pointer reports have @input set, and only
+ * interfaces with input devices have @stats, @activity and (when enabled)
+ * @urbq set.
+ */
+struct keychron_device {
+	struct hid_device *hdev;
+	struct keychron_link *link;
+	struct keychron_input *input;
+	struct keychron_interval_stats *stats;
+	struct keychron_urb_queue *urbq;
+	struct keychron_activity *activity;
+	struct dentry *debugfs;
+	ktime_t report_time;	/* arrival of the report being processed */
+};
+
+/*
+ * Global list of batteries, one per mouse. Multiple HID interfaces probe
+ * for the same physical device, and the wired and wireless transports of
+ * one mouse attach to the same battery.
+ */
+static LIST_HEAD(keychron_batteries);
+static DEFINE_MUTEX(keychron_battery_mutex);
+
+/* Activity trackers, one per USB device. Protected by keychron_battery_mutex */
+static LIST_HEAD(keychron_activities);
+
+/*
+ * Last known state of recently disconnected mice, keyed by power supply
+ * name, so that a replug or hub reset can publish a value straight away
+ * instead of blocking probe on a query. An entry stays until a later
+ * disconnect replaces it, so a device flapping faster than its refresh
+ * query still finds it. The most recently used entry is at the head.
+ * Protected by keychron_battery_mutex.
+ */
+struct keychron_cache_entry {
+	struct list_head node;
+	char *names[2];		/* serial and bus path names of the last link */
+	int battery_capacity;
+	s64 rtt_us[KEYCHRON_LINK_COUNT];
+	ktime_t timestamp;
 };
 
+static LIST_HEAD(keychron_cache);
+static unsigned int keychron_cache_len;
+
+/*
+ * Module-wide cap on queries on the wire at once, so a hub full of
+ * receivers plugged in or resumed together doesn't burst the bus.
+ */
+static unsigned int max_inflight = KEYCHRON_MAX_INFLIGHT;
+module_param(max_inflight, uint, 0444);
+MODULE_PARM_DESC(max_inflight,
+		 "Maximum number of battery queries in flight across all devices (default 2)");
+
+/*
+ * Slots for queries on the wire. Waiters poll the semaphore from
+ * keychron_query_wait rather than sleeping in down(), so that aborting a
+ * link also gets its command out of the queue for a slot.
+ */
+static struct semaphore keychron_query_sem;
+static DECLARE_WAIT_QUEUE_HEAD(keychron_query_wait);
+
+/*
+ * Command work sleeps on the semaphore and on USB completions, and
+ * battery_work waits for it synchronously, so it runs on a queue of its
+ * own rather than tying up system_wq workers.
+ */
+static struct workqueue_struct *keychron_cmd_wq;
+
+static struct dentry *keychron_debugfs_root;
+
+static unsigned int intr_queue_depth;
+module_param(intr_queue_depth, uint, 0444);
+MODULE_PARM_DESC(intr_queue_depth,
+		 "Extra interrupt URBs kept in flight on mouse interfaces, 0-8 (default 0)");
+
+static bool fast_input = true;
+module_param(fast_input, bool, 0444);
+MODULE_PARM_DESC(fast_input,
+		 "Decode plain mouse reports directly instead of through generic HID parsing (default true)");
+
 static enum power_supply_property keychron_battery_props[] = {
 	POWER_SUPPLY_PROP_STATUS,
 	POWER_SUPPLY_PROP_PRESENT,
@@ -78,24 +388,30 @@ static int keychron_battery_get_property(struct power_supply *psy,
 					 enum power_supply_property psp,
 					 union power_supply_propval *val)
 {
-	struct keychron_device *kdev = power_supply_get_drvdata(psy);
+	struct keychron_battery *kbat = power_supply_get_drvdata(psy);
 
 	switch (psp) {
 	case POWER_SUPPLY_PROP_STATUS:
-		val->intval = POWER_SUPPLY_STATUS_DISCHARGING;
+		/* The cable only carries data while it is charging the mouse */
+		if (!READ_ONCE(kbat->links[KEYCHRON_LINK_WIRED]))
+			val->intval = POWER_SUPPLY_STATUS_DISCHARGING;
+		else if (kbat->battery_capacity == 100)
+			val->intval = POWER_SUPPLY_STATUS_FULL;
+		else
+			val->intval = POWER_SUPPLY_STATUS_CHARGING;
 		break;
 	case POWER_SUPPLY_PROP_PRESENT:
 		val->intval = 1;
 		break;
 	case POWER_SUPPLY_PROP_CAPACITY:
-		val->intval = kdev->battery_capacity;
+		val->intval = kbat->battery_capacity;
 		break;
 	case POWER_SUPPLY_PROP_CAPACITY_LEVEL:
-		if (kdev->battery_capacity >= 80)
+		if (kbat->battery_capacity >= 80)
 			val->intval = POWER_SUPPLY_CAPACITY_LEVEL_HIGH;
-		else if (kdev->battery_capacity >= 40)
+		else if (kbat->battery_capacity >= 40)
 			val->intval = POWER_SUPPLY_CAPACITY_LEVEL_NORMAL;
-		else if (kdev->battery_capacity >= 10)
+		else if (kbat->battery_capacity >= 10)
 			val->intval = POWER_SUPPLY_CAPACITY_LEVEL_LOW;
 		else
 			val->intval = POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL;
@@ -115,132 +431,565 @@ static int keychron_battery_get_property(struct power_supply *psy,
 	return 0;
 }
 
+static void keychron_link_update_rtt(struct keychron_link *link, s64 sample)
+{
+	/* Exponentially weighted, 1/8 per sample like TCP's SRTT */
+	if (!link->rtt_us || link->rtt_us == KEYCHRON_RTT_UNREACHABLE_US)
+		link->rtt_us = sample;
+	else
+		link->rtt_us += (sample - link->rtt_us) / 8;
+}
+
+/*
+ * Garble an interrupt report as a bad link might: its report ID, its
+ * command echo or its payload. Done before the report is checked, so
+ * that wrong-ID and wrong-echo reports reach the validation as well.
+ */
+static void keychron_corrupt_report(u8 *data, int len)
+{
+	if (len < 2)
+		return;
+
+	switch (get_random_u32_below(3)) {
+	case 0:
+		data[0] ^= 1 + get_random_u32_below(255);
+		break;
+	case 1:
+		data[1] ^= 1 + get_random_u32_below(255);
+		break;
+	default:
+		get_random_bytes(&data[2], len - 2);
+		break;
+	}
+}
+
 static void keychron_urb_complete(struct urb *urb)
 {
-	struct keychron_device *kdev = urb->context;
-	u8 *data = kdev->intr_buf;
+	struct keychron_link *link = urb->context;
+	struct keychron_cmd *cmd = link->cmd_active;
+	u8 *data = link->intr_buf;
+	int waiting_id;
 
 	if (urb->status)
 		return;
 
-	if (!atomic_read(&kdev->waiting_response))
-		return;
+	if (keychron_fault(link, corrupt_response))
+		keychron_corrupt_report(data, urb->actual_length);
 
-	/* Validate response: report ID 0xB4, command echo 0x06, valid length */
-	if (urb->actual_length >= KEYCHRON_BATTERY_OFFSET + 1 &&
-	    data[0] == KEYCHRON_REPORT_ID_RESP &&
-	    data[1] == KEYCHRON_CMD_STATUS &&
-	    data[KEYCHRON_BATTERY_OFFSET] <= 100) {
-		kdev->pending_battery = data[KEYCHRON_BATTERY_OFFSET];
-		complete(&kdev->response_received);
+	waiting_id = atomic_read(&link->waiting_response) ? cmd->id : -1;
+
+	switch (keychron_response_action(data, urb->actual_length,
+					 waiting_id)) {
+	case KEYCHRON_RESP_STALE:
+		return;
+	case KEYCHRON_RESP_ACCEPT:
+		if (keychron_fault(link, drop_response))
+			break;
+		cmd->resp_len = min_t(u32, urb->actual_length,
+				      KEYCHRON_REPORT_SIZE);
+		memcpy(cmd->resp, data, cmd->resp_len);
+		atomic_set(&link->waiting_response, 0);
+		complete(&link->response_received);
+		return;
+	case KEYCHRON_RESP_IGNORE:
+		break;
 	}
+
+	/* Not ours, keep listening for the real response */
+	usb_submit_urb(urb, GFP_ATOMIC);
+}
+
+static void keychron_ctrl_complete(struct urb *urb)
+{
+	struct keychron_link *link = urb->context;
+
+	complete(&link->ctrl_done);
 }
 
-static int keychron_query_battery_once(struct keychron_device *kdev, u8 *buf)
+/* Put one command on the wire and wait for its response */
+static int keychron_cmd_transfer(struct keychron_link *link,
+				 struct keychron_cmd *cmd)
 {
+	u8 *buf = link->cmd_buf;
 	int ret;
 	int intf_num;
 	unsigned long timeout;
+	unsigned long delay;
+	ktime_t start;
+	s64 rtt;
 
 	/* Prepare for interrupt response */
-	reinit_completion(&kdev->response_received);
-	kdev->pending_battery = -1;
-	atomic_set(&kdev->waiting_response, 1);
+	reinit_completion(&link->response_received);
+	cmd->resp_len = 0;
+	link->cmd_active = cmd;
+	atomic_set(&link->waiting_response, 1);
 
 	/* Submit URB to receive interrupt response */
-	usb_fill_int_urb(kdev->intr_urb, kdev->udev,
-			 usb_rcvintpipe(kdev->udev, kdev->intr_ep),
-			 kdev->intr_buf, KEYCHRON_REPORT_SIZE,
-			 keychron_urb_complete, kdev,
-			 kdev->intr_interval);
+	usb_fill_int_urb(link->intr_urb, link->udev,
+			 usb_rcvintpipe(link->udev, link->intr_ep),
+			 link->intr_buf, KEYCHRON_REPORT_SIZE,
+			 keychron_urb_complete, link,
+			 link->intr_interval);
 
-	ret = usb_submit_urb(kdev->intr_urb, GFP_KERNEL);
+	ret = usb_submit_urb(link->intr_urb, GFP_KERNEL);
 	if (ret < 0)
 		goto out;
 
-	/* Send status request via control endpoint (SET_REPORT feature) */
+	/* Build the feature report and its SET_REPORT setup packet */
 	memset(buf, 0, KEYCHRON_REPORT_SIZE);
 	buf[0] = KEYCHRON_REPORT_ID_CMD;
-	buf[1] = KEYCHRON_CMD_STATUS;
-
-	intf_num = kdev->intf->cur_altsetting->desc.bInterfaceNumber;
-
-	ret = usb_control_msg(kdev->udev,
-			      usb_sndctrlpipe(kdev->udev, 0),
-			      HID_REQ_SET_REPORT,
-			      USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
-			      (HID_FEATURE_REPORT << 8) | KEYCHRON_REPORT_ID_CMD,
-			      intf_num,
-			      buf, KEYCHRON_REPORT_SIZE,
-			      KEYCHRON_USB_TIMEOUT_MS);
+	buf[1] = cmd->id;
+	memcpy(&buf[2], cmd->payload, sizeof(cmd->payload));
+
+	intf_num = link->intf->cur_altsetting->desc.bInterfaceNumber;
+	link->ctrl_req->bRequestType = USB_DIR_OUT | USB_TYPE_CLASS |
+				       USB_RECIP_INTERFACE;
+	link->ctrl_req->bRequest = HID_REQ_SET_REPORT;
+	link->ctrl_req->wValue = cpu_to_le16((HID_FEATURE_REPORT << 8) |
+					     KEYCHRON_REPORT_ID_CMD);
+	link->ctrl_req->wIndex = cpu_to_le16(intf_num);
+	link->ctrl_req->wLength = cpu_to_le16(KEYCHRON_REPORT_SIZE);
+
+	/*
+	 * Send the command via control endpoint (SET_REPORT feature). This
+	 * is usb_control_msg() with a URB of our own, so that an abort can
+	 * kill it instead of waiting for the timeout.
+	 */
+	usb_fill_control_urb(link->ctrl_urb, link->udev,
+			     usb_sndctrlpipe(link->udev, 0),
+			     (u8 *)link->ctrl_req, buf, KEYCHRON_REPORT_SIZE,
+			     keychron_ctrl_complete, link);
+	reinit_completion(&link->ctrl_done);
+	start = ktime_get();
+
+	if (keychron_fault(link, ctrl_error))
+		ret = -EPIPE;
+	else
+		ret = usb_submit_urb(link->ctrl_urb, GFP_KERNEL);
+	if (!ret) {
+		timeout = msecs_to_jiffies(KEYCHRON_USB_TIMEOUT_MS);
+		if (wait_for_completion_timeout(&link->ctrl_done, timeout)) {
+			ret = link->ctrl_urb->status;
+		} else {
+			usb_kill_urb(link->ctrl_urb);
+			ret = -ETIMEDOUT;
+		}
+	}
 	if (ret < 0) {
-		usb_kill_urb(kdev->intr_urb);
+		usb_kill_urb(link->intr_urb);
 		goto out;
 	}
 
 	/* Wait for interrupt response */
-	timeout = wait_for_completion_timeout(&kdev->response_received,
-			msecs_to_jiffies(KEYCHRON_RESPONSE_TIMEOUT_MS));
-
-	usb_kill_urb(kdev->intr_urb);
-
-	if (timeout && kdev->pending_battery >= 0)
-		return kdev->pending_battery;
+	timeout = wait_for_completion_timeout(&link->response_received,
+					      msecs_to_jiffies(cmd->timeout_ms));
+
+	usb_kill_urb(link->intr_urb);
+
+	if (timeout && keychron_fault(link, delay_response)) {
+		/* Past the remaining wait, the response counts as late */
+		delay = get_random_u32_below(2 * cmd->timeout_ms);
+		delay = msecs_to_jiffies(delay);
+		wait_event_timeout(link->abort_wait, READ_ONCE(link->cmd_dead),
+				   min(delay, timeout));
+		if (delay >= timeout)
+			timeout = 0;
+	}
 
-	return -ETIMEDOUT;
+	if (READ_ONCE(link->cmd_dead)) {
+		ret = -ENODEV;
+	} else if (timeout) {
+		rtt = ktime_us_delta(ktime_get(), start);
+		hid_dbg(link->hdev, "query rtt %lld us\n", rtt);
+		keychron_link_update_rtt(link, rtt);
+		spin_lock(&link->stats.lock);
+		link->stats.rtt_hist[min_t(int, fls64(rtt),
+					   KEYCHRON_RTT_BUCKETS - 1)]++;
+		spin_unlock(&link->stats.lock);
+		ret = cmd->resp_len;
+	} else {
+		spin_lock(&link->stats.lock);
+		link->stats.timeouts++;
+		spin_unlock(&link->stats.lock);
+		ret = -ETIMEDOUT;
+	}
 
 out:
-	atomic_set(&kdev->waiting_response, 0);
+	/* Poisoned URBs fail with -EPERM or -ENOENT, report the real cause */
+	if (ret < 0 && READ_ONCE(link->cmd_dead))
+		ret = -ENODEV;
+	atomic_set(&link->waiting_response, 0);
+	link->cmd_active = NULL;
 	return ret;
 }
 
-static int keychron_query_battery(struct keychron_device *kdev)
+static bool keychron_query_slot_try(struct keychron_link *link, int *ret)
+{
+	if (READ_ONCE(link->cmd_dead)) {
+		*ret = -ENODEV;
+		return true;
+	}
+	if (down_trylock(&keychron_query_sem))
+		return false;
+	*ret = 0;
+	return true;
+}
+
+/* Take a query slot, or fail with -ENODEV once @link is aborted */
+static int keychron_query_slot_get(struct keychron_link *link)
 {
-	u8 *buf;
 	int ret;
-	int attempt;
 
-	if (!kdev->udev || !kdev->intr_urb)
-		return -ENODEV;
+	wait_event(keychron_query_wait, keychron_query_slot_try(link, &ret));
+	return ret;
+}
 
-	buf = kmalloc(KEYCHRON_REPORT_SIZE, GFP_KERNEL);
-	if (!buf)
-		return -ENOMEM;
+static void keychron_query_slot_put(void)
+{
+	up(&keychron_query_sem);
+	wake_up(&keychron_query_wait);
+}
 
-	for (attempt = 0; attempt < KEYCHRON_QUERY_RETRIES; attempt++) {
-		if (attempt > 0)
-			msleep(KEYCHRON_RETRY_DELAY_MS);
+static void keychron_cmd_work(struct work_struct *work)
+{
+	struct keychron_link *link = container_of(work, struct keychron_link,
+						  cmd_work);
+	struct keychron_cmd *cmd;
+	int ret;
 
-		ret = keychron_query_battery_once(kdev, buf);
-		atomic_set(&kdev->waiting_response, 0);
+	for (;;) {
+		spin_lock(&link->cmd_lock);
+		cmd = list_first_entry_or_null(&link->cmd_queue,
+					       struct keychron_cmd, node);
+		if (cmd)
+			list_del_init(&cmd->node);
+		spin_unlock(&link->cmd_lock);
 
-		if (ret >= 0)
+		if (!cmd)
 			break;
+
+		ret = keychron_query_slot_get(link);
+		if (!ret) {
+			ret = keychron_cmd_transfer(link, cmd);
+			keychron_query_slot_put();
+		}
+
+		cmd->done(cmd, ret);
+	}
+}
+
+static void keychron_cmd_init(struct keychron_cmd *cmd, u8 id)
+{
+	memset(cmd, 0, sizeof(*cmd));
+	INIT_LIST_HEAD(&cmd->node);
+	cmd->id = id;
+	cmd->timeout_ms = KEYCHRON_RESPONSE_TIMEOUT_MS;
+}
+
+/* Queue a command; @cmd->done is called once it has completed or failed */
+static int keychron_cmd_submit(struct keychron_link *link,
+			       struct keychron_cmd *cmd)
+{
+	int ret = 0;
+
+	spin_lock(&link->cmd_lock);
+	if (link->cmd_dead)
+		ret = -ENODEV;
+	else
+		list_add_tail(&cmd->node, &link->cmd_queue);
+	spin_unlock(&link->cmd_lock);
+
+	if (!ret)
+		queue_work(keychron_cmd_wq, &link->cmd_work);
+	return ret;
+}
+
+static void keychron_cmd_exec_done(struct keychron_cmd *cmd, int status)
+{
+	cmd->status = status;
+	complete(cmd->context);
+}
+
+/* Queue a command and wait for it, returning the response length */
+static int keychron_cmd_exec(struct keychron_link *link,
+			     struct keychron_cmd *cmd)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	int ret;
+
+	cmd->done = keychron_cmd_exec_done;
+	cmd->context = &done;
+
+	ret = keychron_cmd_submit(link, cmd);
+	if (ret)
+		return ret;
+
+	wait_for_completion(&done);
+	return cmd->status;
+}
+
+/*
+ * Fail every command of @link without waiting for the device or for
+ * other devices' queries, and make every later one fail straight away:
+ * the one on the wire, the one waiting for a query slot and those still
+ * queued, which may sit behind other links' work on keychron_cmd_wq.
+ * Called first thing on disconnect, so that tearing the link down
+ * doesn't wait out timeouts, retries or the queries of other devices.
+ */
+static void keychron_cmd_abort(struct keychron_link *link)
+{
+	struct keychron_cmd *cmd;
+	struct keychron_cmd *tmp;
+	LIST_HEAD(pending);
+
+	spin_lock(&link->cmd_lock);
+	WRITE_ONCE(link->cmd_dead, true);
+	list_splice_init(&link->cmd_queue, &pending);
+	spin_unlock(&link->cmd_lock);
+
+	usb_poison_urb(link->ctrl_urb);
+	usb_poison_urb(link->intr_urb);
+	complete(&link->response_received);
+	wake_up(&link->abort_wait);
+	wake_up(&keychron_query_wait);
+
+	list_for_each_entry_safe(cmd, tmp, &pending, node) {
+		list_del_init(&cmd->node);
+		cmd->done(cmd, -ENODEV);
+	}
+}
+
+/* Stop accepting commands and fail everything still queued */
+static void keychron_cmd_shutdown(struct keychron_link *link)
+{
+	struct keychron_cmd *cmd;
+	struct keychron_cmd *tmp;
+	LIST_HEAD(pending);
+
+	spin_lock(&link->cmd_lock);
+	WRITE_ONCE(link->cmd_dead, true);
+	list_splice_init(&link->cmd_queue, &pending);
+	spin_unlock(&link->cmd_lock);
+
+	cancel_work_sync(&link->cmd_work);
+
+	list_for_each_entry_safe(cmd, tmp, &pending, node) {
+		list_del_init(&cmd->node);
+		cmd->done(cmd, -ENODEV);
 	}
+}
+
+static int keychron_query_transfer(void *ctx, u8 *resp, int size)
+{
+	struct keychron_link *link = ctx;
+	struct keychron_cmd cmd;
+	int ret;
+
+	keychron_cmd_init(&cmd, KEYCHRON_CMD_STATUS);
+	ret = keychron_cmd_exec(link, &cmd);
+	if (ret > 0)
+		memcpy(resp, cmd.resp, min(ret, size));
+	return ret;
+}
+
+static void keychron_query_backoff(void *ctx, int attempt)
+{
+	struct keychron_link *link = ctx;
+	unsigned int delay;
+
+	/* Jitter retries so devices that failed together spread out */
+	delay = KEYCHRON_RETRY_DELAY_MS +
+		get_random_u32_below(KEYCHRON_RETRY_DELAY_MS);
+	wait_event_timeout(link->abort_wait, READ_ONCE(link->cmd_dead),
+			   msecs_to_jiffies(delay));
+}
+
+static const struct keychron_query_ops keychron_query_ops = {
+	.transfer = keychron_query_transfer,
+	.backoff = keychron_query_backoff,
+};
+
+static int keychron_query_battery(struct keychron_link *link)
+{
+	int attempts;
+	int ret;
+
+	if (!link->udev || !link->intr_urb)
+		return -ENODEV;
+
+	ret = keychron_query_status(&keychron_query_ops, link,
+				    KEYCHRON_QUERY_RETRIES, &attempts);
+
+	spin_lock(&link->stats.lock);
+	link->stats.queries++;
+	link->stats.attempts += attempts;
+	if (ret < 0)
+		link->stats.failed++;
+	spin_unlock(&link->stats.lock);
 
-	if (ret < 0 && attempt == KEYCHRON_QUERY_RETRIES)
-		hid_dbg(kdev->hdev, "battery query failed after %d attempts\n",
+	if (ret < 0 && ret != -ENODEV) {
+		hid_dbg(link->hdev, "battery query failed after %d attempts\n",
 			KEYCHRON_QUERY_RETRIES);
+		/* Rank a link that stopped answering behind any that does */
+		link->rtt_us = KEYCHRON_RTT_UNREACHABLE_US;
+	}
+
+	return ret;
+}
+
+/*
+ * Pick the link to query: the one with the lower measured round trip,
+ * or the cable while either link has not been measured yet.
+ */
+static struct keychron_link *keychron_select_link(struct keychron_battery *kbat)
+{
+	struct keychron_link *wired = kbat->links[KEYCHRON_LINK_WIRED];
+	struct keychron_link *wireless = kbat->links[KEYCHRON_LINK_WIRELESS];
+
+	if (!wired || !wireless)
+		return wired ? wired : wireless;
+
+	if (!wired->rtt_us || !wireless->rtt_us)
+		return wired;
+
+	return wireless->rtt_us < wired->rtt_us ? wireless : wired;
+}
+
+/*
+ * Whether a query over @link would reach a mouse that has gone to sleep,
+ * or will before the query finishes. The mouse sleeps once it has seen no
+ * input for its idle timeout, and only does so when it isn't on a cable.
+ */
+static bool keychron_link_asleep(struct keychron_battery *kbat,
+				 struct keychron_link *link)
+{
+	unsigned int timeout = READ_ONCE(kbat->sleep_timeout_s);
+	unsigned long asleep;
+
+	if (!timeout || link->type != KEYCHRON_LINK_WIRELESS || !link->activity)
+		return false;
+
+	asleep = READ_ONCE(link->activity->last_input) +
+		 msecs_to_jiffies(timeout * MSEC_PER_SEC -
+				  KEYCHRON_SLEEP_GUARD_MS);
+	return time_after_eq(jiffies, asleep);
+}
+
+/*
+ * How long to hold off querying over @link, or 0 if it can be queried
+ * now. Besides a sleeping mouse, that is while a hidraw user such as the
+ * Keychron Launcher has the vendor interface open: its 0xB4 responses
+ * arrive on the same endpoint as ours, so either side could take the
+ * other's. Drivers aren't told when hidraw is opened, so this is only
+ * checked before each query; one already in flight still races. The
+ * pause is logged, since a daemon that keeps the node open would
+ * otherwise stop battery reporting without a trace. Called with
+ * @kbat->lock held.
+ */
+static unsigned int keychron_link_wait_ms(struct keychron_battery *kbat,
+					  struct keychron_link *link)
+{
+	struct hidraw *hidraw = link->hdev->hidraw;
+
+	if (hidraw && READ_ONCE(hidraw->open)) {
+		if (!link->hidraw_paused)
+			hid_info(link->hdev,
+				 "hidraw node in use, pausing battery queries\n");
+		link->hidraw_paused = true;
+		return KEYCHRON_HIDRAW_RECHECK_MS;
+	}
+	if (link->hidraw_paused) {
+		hid_info(link->hdev, "hidraw node closed, resuming battery queries\n");
+		link->hidraw_paused = false;
+	}
+	if (keychron_link_asleep(kbat, link))
+		return KEYCHRON_SLEEP_RECHECK_MS;
+	return 0;
+}
+
+/*
+ * Query @link with @kbat->lock dropped, so that detaching either link,
+ * and with it every other Keychron probe and remove, doesn't wait for
+ * the query. @link stays valid until @busy_link is cleared, but may have
+ * been detached by the time the lock is held again.
+ */
+static int keychron_query_unlocked(struct keychron_battery *kbat,
+				   struct keychron_link *link)
+{
+	int ret;
+
+	WRITE_ONCE(kbat->busy_link, link);
+	mutex_unlock(&kbat->lock);
+
+	ret = keychron_query_battery(link);
+
+	mutex_lock(&kbat->lock);
+	WRITE_ONCE(kbat->busy_link, NULL);
+	wake_up_all(&kbat->idle_wait);
 
-	kfree(buf);
 	return ret;
 }
 
 static void keychron_battery_work(struct work_struct *work)
 {
-	struct keychron_device *kdev = container_of(work, struct keychron_device,
-						    battery_work.work);
+	struct keychron_battery *kbat = container_of(work,
+						     struct keychron_battery,
+						     battery_work.work);
+	struct keychron_link *link;
+	struct keychron_link *other;
+	unsigned int delay = KEYCHRON_POLL_INTERVAL_MS;
+	enum keychron_link_type type;
+	unsigned int wait;
 	int battery;
 
-	battery = keychron_query_battery(kdev);
-	if (battery >= 0 && battery != kdev->battery_capacity) {
-		kdev->battery_capacity = battery;
-		power_supply_changed(kdev->battery);
-		hid_dbg(kdev->hdev, "battery: %d%%\n", battery);
+	mutex_lock(&kbat->lock);
+
+	/* Only the preferred link is polled; the other is a fallback */
+	link = keychron_select_link(kbat);
+	if (!link) {
+		/* Last link is being detached */
+		mutex_unlock(&kbat->lock);
+		return;
+	}
+	other = kbat->links[!link->type];
+
+	/*
+	 * A sleeping mouse doesn't answer until it is moved again, and a
+	 * hidraw user would race us for the responses. Use the other link
+	 * if it is free, otherwise keep checking and query as soon as the
+	 * mouse wakes up or the hidraw user goes away.
+	 */
+	wait = keychron_link_wait_ms(kbat, link);
+	if (wait) {
+		if (!other || keychron_link_wait_ms(kbat, other)) {
+			delay = wait;
+			goto out_unlock;
+		}
+		swap(link, other);
+	}
+
+	/* Either link may have come or gone while the lock was dropped */
+	type = link->type;
+	battery = keychron_query_unlocked(kbat, link);
+	other = kbat->links[!type];
+	if (battery < 0 && other && !keychron_link_wait_ms(kbat, other))
+		battery = keychron_query_unlocked(kbat, other);
+
+	if (battery >= 0 &&
+	    (battery != kbat->battery_capacity || kbat->capacity_cached)) {
+		kbat->battery_capacity = battery;
+		kbat->capacity_cached = false;
+		if (kbat->battery) {
+			power_supply_changed(kbat->battery);
+			dev_dbg(&kbat->battery->dev, "battery: %d%%\n",
+				battery);
+		}
 	}
 
-	schedule_delayed_work(&kdev->battery_work,
-			      msecs_to_jiffies(KEYCHRON_POLL_INTERVAL_MS));
+out_unlock:
+	mutex_unlock(&kbat->lock);
+
+	schedule_delayed_work(&kbat->battery_work, msecs_to_jiffies(delay));
 }
 
 static bool keychron_is_vendor_interface(struct hid_device *hdev)
@@ -272,27 +1021,1294 @@ static int keychron_find_intr_endpoint(struct usb_interface *intf,
 	return -ENOENT;
 }
 
-static void keychron_cleanup_battery(struct keychron_device *kdev)
+/* Polling period of an interrupt endpoint's bInterval, in microseconds */
+static unsigned int keychron_interval_us(struct usb_device *udev,
+					 int interval)
 {
-	kfree(kdev->intr_buf);
-	kdev->intr_buf = NULL;
-	usb_free_urb(kdev->intr_urb);
-	kdev->intr_urb = NULL;
-	usb_put_dev(kdev->udev);
-	kdev->udev = NULL;
+	/* High speed and up count 2^(bInterval-1) microframes */
+	if (udev->speed >= USB_SPEED_HIGH)
+		return 125U << (clamp(interval, 1, 16) - 1);
+	return max(interval, 1) * USEC_PER_MSEC;
+}
+
+/* Find or create the activity tracker of @udev, starting out as awake */
+static struct keychron_activity *keychron_get_activity(struct usb_device *udev)
+{
+	struct keychron_activity *act;
 
 	mutex_lock(&keychron_battery_mutex);
-	keychron_battery_owner = NULL;
-	kdev->owns_battery = false;
+	list_for_each_entry(act, &keychron_activities, node) {
+		if (act->udev == udev) {
+			act->users++;
+			goto out;
+		}
+	}
+
+	act = kzalloc(sizeof(*act), GFP_KERNEL);
+	if (act) {
+		act->udev = udev;
+		act->users = 1;
+		act->last_input = jiffies;
+		list_add(&act->node, &keychron_activities);
+	}
+out:
 	mutex_unlock(&keychron_battery_mutex);
+	return act;
+}
+
+static void keychron_put_activity(struct keychron_activity *act)
+{
+	if (!act)
+		return;
+
+	mutex_lock(&keychron_battery_mutex);
+	if (!--act->users) {
+		list_del(&act->node);
+		kfree(act);
+	}
+	mutex_unlock(&keychron_battery_mutex);
+}
+
+#ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
+static void keychron_init_faults(struct keychron_link *link,
+				 struct dentry *parent)
+{
+	struct keychron_faults *f = &link->faults;
+
+	f->ctrl_error = (struct fault_attr)FAULT_ATTR_INITIALIZER;
+	f->drop_response = (struct fault_attr)FAULT_ATTR_INITIALIZER;
+	f->delay_response = (struct fault_attr)FAULT_ATTR_INITIALIZER;
+	f->corrupt_response = (struct fault_attr)FAULT_ATTR_INITIALIZER;
+
+	fault_create_debugfs_attr("fail_ctrl", parent, &f->ctrl_error);
+	fault_create_debugfs_attr("drop_response", parent, &f->drop_response);
+	fault_create_debugfs_attr("delay_response", parent,
+				  &f->delay_response);
+	fault_create_debugfs_attr("corrupt_response", parent,
+				  &f->corrupt_response);
+}
+#else
+static inline void keychron_init_faults(struct keychron_link *link,
+					struct dentry *parent)
+{
+}
+#endif
+
+static void keychron_free_link(struct keychron_link *link)
+{
+	keychron_cmd_shutdown(link);
+	usb_kill_urb(link->intr_urb);
+	kfree(link->ctrl_req);
+	kfree(link->cmd_buf);
+	kfree(link->intr_buf);
+	usb_free_urb(link->ctrl_urb);
+	usb_free_urb(link->intr_urb);
+	keychron_put_activity(link->activity);
+	usb_put_dev(link->udev);
+	kfree(link);
+}
+
+/*
+ * Build a power supply name that stays the same across replugs: the USB
+ * serial number when the device has one, otherwise its bus path.
+ */
+static char *keychron_battery_name(struct usb_device *udev, bool by_path)
+{
+	const char *id = udev->serial;
+	char *name;
+	char *p;
+
+	if (by_path || !id || !*id)
+		id = dev_name(&udev->dev);
+
+	name = kasprintf(GFP_KERNEL, "keychron_mouse_%s", id);
+	if (!name)
+		return NULL;
+
+	/* Keep sysfs and UPower object paths free of odd characters */
+	for (p = name; *p; p++) {
+		if (!isalnum(*p) && *p != '-')
+			*p = '_';
+	}
+	return name;
+}
+
+static bool keychron_battery_name_taken(const char *name)
+{
+	struct power_supply *psy = power_supply_get_by_name(name);
+
+	if (!psy)
+		return false;
+	power_supply_put(psy);
+	return true;
+}
+
+static void keychron_cache_free(struct keychron_cache_entry *entry)
+{
+	list_del(&entry->node);
+	keychron_cache_len--;
+	kfree(entry->names[0]);
+	kfree(entry->names[1]);
+	kfree(entry);
+}
+
+static struct keychron_cache_entry *keychron_cache_find(const char *name)
+{
+	struct keychron_cache_entry *entry;
+
+	list_for_each_entry(entry, &keychron_cache, node) {
+		if (!strcmp(entry->names[0], name) ||
+		    !strcmp(entry->names[1], name))
+			return entry;
+	}
+	return NULL;
+}
+
+/*
+ * Remember a battery whose last link is going away, under both names
+ * keychron_cache_take() looks a reconnecting link up by. With a shared
+ * serial number the other transport finds it under the serial name too.
+ */
+static void keychron_cache_store(struct keychron_battery *kbat,
+				 struct keychron_link *link)
+{
+	struct keychron_cache_entry *entry;
+	char *names[2];
+
+	/*
+	 * Nothing new to remember until a live query has succeeded; the
+	 * entry the cached value came from is still there.
+	 */
+	if (kbat->capacity_cached)
+		return;
+
+	names[0] = keychron_battery_name(link->udev, false);
+	names[1] = keychron_battery_name(link->udev, true);
+	if (!names[0] || !names[1])
+		goto out_free;
+
+	/* Drop entries under either name, they describe an older state */
+	while ((entry = keychron_cache_find(names[0])))
+		keychron_cache_free(entry);
+	while ((entry = keychron_cache_find(names[1])))
+		keychron_cache_free(entry);
+
+	if (keychron_cache_len == KEYCHRON_CACHE_SIZE)
+		keychron_cache_free(list_last_entry(&keychron_cache,
+						    struct keychron_cache_entry,
+						    node));
+
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		goto out_free;
+	entry->names[0] = names[0];
+	entry->names[1] = names[1];
+	list_add(&entry->node, &keychron_cache);
+	keychron_cache_len++;
+
+	entry->battery_capacity = kbat->battery_capacity;
+	if (link->rtt_us != KEYCHRON_RTT_UNREACHABLE_US)
+		entry->rtt_us[link->type] = link->rtt_us;
+	entry->timestamp = ktime_get_boottime();
+	return;
+
+out_free:
+	kfree(names[0]);
+	kfree(names[1]);
+}
+
+/*
+ * Look up the last known capacity of the device behind a new link and
+ * seed its RTT estimate. Returns -ENOENT on a miss or a stale entry. A
+ * hit is left in place until a fresh value replaces it on disconnect.
+ */
+static int keychron_cache_take(struct keychron_link *link)
+{
+	struct keychron_cache_entry *entry = NULL;
+	char *name;
+	int ret = -ENOENT;
+	int i;
+
+	mutex_lock(&keychron_battery_mutex);
+
+	/* Try the serial number name first, then the bus path one */
+	for (i = 0; i < 2 && !entry; i++) {
+		name = keychron_battery_name(link->udev, i);
+		if (!name)
+			break;
+		entry = keychron_cache_find(name);
+		kfree(name);
+	}
+
+	if (entry && ktime_ms_delta(ktime_get_boottime(), entry->timestamp) >=
+		     KEYCHRON_CACHE_MAX_AGE_MS) {
+		keychron_cache_free(entry);
+	} else if (entry) {
+		ret = entry->battery_capacity;
+		link->rtt_us = entry->rtt_us[link->type];
+		list_move(&entry->node, &keychron_cache);
+	}
+
+	mutex_unlock(&keychron_battery_mutex);
+	return ret;
+}
+
+static void keychron_cache_clear(void)
+{
+	struct keychron_cache_entry *entry;
+	struct keychron_cache_entry *tmp;
+
+	mutex_lock(&keychron_battery_mutex);
+	list_for_each_entry_safe(entry, tmp, &keychron_cache, node)
+		keychron_cache_free(entry);
+	mutex_unlock(&keychron_battery_mutex);
+}
+
+static ssize_t capacity_cached_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct keychron_battery *kbat =
+		power_supply_get_drvdata(to_power_supply(dev));
+
+	return sysfs_emit(buf, "%d\n", kbat->capacity_cached);
+}
+static DEVICE_ATTR_RO(capacity_cached);
+
+/*
+ * The mouse's idle-to-sleep time as configured on the device, in seconds.
+ * The driver can't read or change it over the vendor protocol, so it has
+ * to be told; 0 means unknown and polls regardless of idle time.
+ */
+static ssize_t sleep_timeout_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct keychron_battery *kbat =
+		power_supply_get_drvdata(to_power_supply(dev));
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(kbat->sleep_timeout_s));
+}
+
+static ssize_t sleep_timeout_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct keychron_battery *kbat =
+		power_supply_get_drvdata(to_power_supply(dev));
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+	if (val && (val < KEYCHRON_SLEEP_TIMEOUT_MIN_S ||
+		    val > KEYCHRON_SLEEP_TIMEOUT_MAX_S))
+		return -EINVAL;
+
+	WRITE_ONCE(kbat->sleep_timeout_s, val);
+	return count;
+}
+static DEVICE_ATTR_RW(sleep_timeout);
+
+static struct attribute *keychron_battery_attrs[] = {
+	&dev_attr_capacity_cached.attr,
+	&dev_attr_sleep_timeout.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(keychron_battery);
+
+static int keychron_register_battery(struct keychron_battery *kbat,
+				     struct hid_device *hdev)
+{
+	struct power_supply_config psy_cfg = {};
+	int ret;
+
+	kbat->battery_desc.name = kbat->name;
+	kbat->battery_desc.type = POWER_SUPPLY_TYPE_BATTERY;
+	kbat->battery_desc.properties = keychron_battery_props;
+	kbat->battery_desc.num_properties = ARRAY_SIZE(keychron_battery_props);
+	kbat->battery_desc.get_property = keychron_battery_get_property;
+
+	psy_cfg.drv_data = kbat;
+	psy_cfg.attr_grp = keychron_battery_groups;
+
+	kbat->battery = power_supply_register(&hdev->dev, &kbat->battery_desc,
+					      &psy_cfg);
+	if (IS_ERR(kbat->battery)) {
+		ret = PTR_ERR(kbat->battery);
+		kbat->battery = NULL;
+		hid_err(hdev, "failed to register power supply: %d\n", ret);
+		return ret;
+	}
+	return 0;
+}
+
+/*
+ * Find the battery a new link belongs to. The status report carries no
+ * mouse identifier, so the only thing tying the receiver to the mouse on
+ * the cable is a USB serial number both of them report. A link joins a
+ * battery that is missing its transport and whose other link has the
+ * same serial; without a serial, or with more than one candidate, it
+ * gets a battery of its own rather than risk merging two mice.
+ */
+static struct keychron_battery *
+keychron_find_battery(struct keychron_link *link)
+{
+	const char *serial = link->udev->serial;
+	struct keychron_battery *kbat;
+	struct keychron_battery *found = NULL;
+	struct keychron_link *other;
+
+	if (!serial || !*serial)
+		return NULL;
+
+	list_for_each_entry(kbat, &keychron_batteries, node) {
+		other = kbat->links[!link->type];
+		if (kbat->links[link->type] || !other ||
+		    !other->udev->serial || strcmp(other->udev->serial, serial))
+			continue;
+		if (found)
+			return NULL;
+		found = kbat;
+	}
+	return found;
+}
+
+/*
+ * Attach a link to the mouse's battery, creating and registering the
+ * battery if this is the first link. @battery is either the answer to a
+ * status query or, when @cached is set, the last value seen before the
+ * device was disconnected.
+ */
+static int keychron_attach_link(struct keychron_link *link, int battery,
+				bool cached)
+{
+	unsigned long delay;
+	struct keychron_battery *kbat;
+	int ret = 0;
+
+	mutex_lock(&keychron_battery_mutex);
+
+	kbat = keychron_find_battery(link);
+	if (kbat) {
+		mutex_lock(&kbat->lock);
+		WRITE_ONCE(kbat->links[link->type], link);
+		link->kbat = kbat;
+		if (!cached)
+			kbat->battery_capacity = battery;
+		if (kbat->battery)
+			power_supply_changed(kbat->battery);
+		mutex_unlock(&kbat->lock);
+		goto out;
+	}
+
+	kbat = kzalloc(sizeof(*kbat), GFP_KERNEL);
+	if (!kbat) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	mutex_init(&kbat->lock);
+	init_waitqueue_head(&kbat->idle_wait);
+	INIT_DELAYED_WORK(&kbat->battery_work, keychron_battery_work);
+	kbat->battery_capacity = battery;
+	kbat->capacity_cached = cached;
+	kbat->links[link->type] = link;
+	link->kbat = kbat;
+
+	/* Units sharing a serial number fall back to their bus path */
+	kbat->name = keychron_battery_name(link->udev, false);
+	if (kbat->name && keychron_battery_name_taken(kbat->name)) {
+		kfree(kbat->name);
+		kbat->name = keychron_battery_name(link->udev, true);
+	}
+	if (!kbat->name) {
+		ret = -ENOMEM;
+		goto err_free_battery;
+	}
+
+	ret = keychron_register_battery(kbat, link->hdev);
+	if (ret)
+		goto err_free_battery;
+
+	list_add_tail(&kbat->node, &keychron_batteries);
+
+	/*
+	 * Start each device at a random phase of the poll interval so that
+	 * devices attached together don't stay in lockstep. A cached value
+	 * is only a placeholder, so refresh it within a second instead.
+	 */
+	if (cached)
+		delay = get_random_u32_below(MSEC_PER_SEC);
+	else
+		delay = KEYCHRON_POLL_INTERVAL_MS / 2 +
+			get_random_u32_below(KEYCHRON_POLL_INTERVAL_MS / 2);
+	schedule_delayed_work(&kbat->battery_work, msecs_to_jiffies(delay));
+
+	mutex_unlock(&keychron_battery_mutex);
+	return 0;
+
+err_free_battery:
+	link->kbat = NULL;
+	kfree(kbat->name);
+	mutex_destroy(&kbat->lock);
+	kfree(kbat);
+out:
+	mutex_unlock(&keychron_battery_mutex);
+	return ret;
+}
+
+/*
+ * Detach a link from its battery. The battery survives as long as the
+ * other transport is still connected, so plugging or unplugging the
+ * charging cable only flips STATUS instead of re-creating the device.
+ */
+static void keychron_detach_link(struct keychron_link *link)
+{
+	struct keychron_battery *kbat = link->kbat;
+	struct keychron_link *other;
+
+	mutex_lock(&keychron_battery_mutex);
+	mutex_lock(&kbat->lock);
+
+	WRITE_ONCE(kbat->links[link->type], NULL);
+	other = kbat->links[!link->type];
+	if (!other) {
+		keychron_cache_store(kbat, link);
+		list_del(&kbat->node);
+	} else if (kbat->battery &&
+		   kbat->battery->dev.parent == &link->hdev->dev) {
+		/*
+		 * The power supply cannot outlive its parent interface, so it
+		 * moves to the other link under the same name. Userspace sees
+		 * a remove and an add; see the README.
+		 */
+		power_supply_unregister(kbat->battery);
+		keychron_register_battery(kbat, other->hdev);
+	} else if (kbat->battery) {
+		power_supply_changed(kbat->battery);
+	}
+
+	mutex_unlock(&kbat->lock);
+	mutex_unlock(&keychron_battery_mutex);
+
+	/* The caller has aborted our commands, so this is short */
+	wait_event(kbat->idle_wait, READ_ONCE(kbat->busy_link) != link);
+
+	if (!other) {
+		cancel_delayed_work_sync(&kbat->battery_work);
+		if (kbat->battery)
+			power_supply_unregister(kbat->battery);
+		kfree(kbat->name);
+		mutex_destroy(&kbat->lock);
+		kfree(kbat);
+	}
+}
+
+/*
+ * Input fast path.
+ *
+ * At 8 kHz the generic hid-core path (field extraction into the report's
+ * value arrays, then hidinput's per-usage event mapping) dominates the
+ * per-report cost. Mouse reports only need button and relative axis
+ * values, so reports made up solely of variable EV_KEY/EV_REL usages get
+ * a flat decoder built from hid-input's own mapping at probe time, and
+ * raw_event turns them straight into input events. Anything else, or any
+ * report the decoder doesn't fully cover, takes the generic path.
+ */
+static struct keychron_fast_report *
+keychron_build_fast_report(struct hid_device *hdev, struct hid_report *report)
+{
+	struct keychron_fast_report *fr;
+	struct keychron_fast_usage *fu;
+	struct input_dev *input = NULL;
+	struct hid_field *field;
+	struct hid_usage *usage;
+	unsigned int i;
+	unsigned int j;
+
+	fr = devm_kzalloc(&hdev->dev,
+			  struct_size(fr, usages, KEYCHRON_FAST_USAGES_MAX),
+			  GFP_KERNEL);
+	if (!fr)
+		return NULL;
+
+	for (i = 0; i < report->maxfield; i++) {
+		field = report->field[i];
+
+		if (!(field->flags & HID_MAIN_ITEM_VARIABLE) ||
+		    !field->hidinput || field->report_size > 32 ||
+		    field->report_count > field->maxusage)
+			goto reject;
+
+		/* Everything must go to a single input device */
+		if (input && input != field->hidinput->input)
+			goto reject;
+		input = field->hidinput->input;
+
+		for (j = 0; j < field->report_count; j++) {
+			usage = &field->usage[j];
+
+			/* Usages hid-input ignored are skipped there too */
+			if (!usage->type ||
+			    (usage->type == EV_KEY && !usage->code))
+				continue;
+
+			if (usage->type != EV_KEY && usage->type != EV_REL)
+				goto reject;
+
+			/* One-shot keys need hid-input's press/release pair */
+			if (usage->type == EV_KEY &&
+			    (field->flags & HID_MAIN_ITEM_RELATIVE))
+				goto reject;
+
+			if (fr->num_usages == KEYCHRON_FAST_USAGES_MAX)
+				goto reject;
+
+			fu = &fr->usages[fr->num_usages++];
+			fu->usage = usage;
+			fu->offset = field->report_offset +
+				     j * field->report_size;
+			fu->size = field->report_size;
+			fu->is_signed = field->logical_minimum < 0;
+			fu->ranged = !(field->flags & (HID_MAIN_ITEM_RELATIVE |
+						       HID_MAIN_ITEM_BUFFERED_BYTE)) &&
+				     field->logical_minimum <
+				     field->logical_maximum;
+			fu->logical_minimum = field->logical_minimum;
+			fu->logical_maximum = field->logical_maximum;
+		}
+	}
+
+	if (!input || !fr->num_usages)
+		goto reject;
+
+	fr->report = report;
+	fr->input = input;
+	fr->len = DIV_ROUND_UP(report->size, 8);
+	return fr;
+
+reject:
+	devm_kfree(&hdev->dev, fr);
+	return NULL;
+}
+
+/* Same accumulation as hid-input does for high-resolution wheels */
+static void keychron_fast_scroll(struct input_dev *input,
+				 struct hid_usage *usage, s32 value)
+{
+	int hi_res;
+	int lo_res;
+
+	if (!value)
+		return;
+
+	hi_res = value * 120 / usage->resolution_multiplier;
+	usage->wheel_accumulated += hi_res;
+	lo_res = usage->wheel_accumulated / 120;
+	if (lo_res)
+		usage->wheel_accumulated -= lo_res * 120;
+
+	input_event(input, EV_REL,
+		    usage->code == REL_WHEEL_HI_RES ? REL_WHEEL : REL_HWHEEL,
+		    lo_res);
+	input_event(input, EV_REL, usage->code, hi_res);
+}
+
+static void keychron_fast_event(struct input_dev *input,
+				struct hid_usage *usage, s32 value)
+{
+	if (usage->type == EV_REL &&
+	    (usage->code == REL_WHEEL_HI_RES ||
+	     usage->code == REL_HWHEEL_HI_RES)) {
+		keychron_fast_scroll(input, usage, value);
+		return;
+	}
+
+	/* hid-input reports the HID usage of every button change */
+	if (usage->type == EV_KEY &&
+	    !!test_bit(usage->code, input->key) != !!value)
+		input_event(input, EV_MSC, MSC_SCAN, usage->hid);
+
+	input_event(input, usage->type, usage->code, value);
+}
+
+/*
+ * Stamp the frame about to be synced with the time its report arrived,
+ * so it stays accurately timed however late userspace reads it. Only the
+ * pointer input declares MSC_TIMESTAMP; the others are left alone.
+ */
+static void keychron_stamp_frame(struct input_dev *input, ktime_t time)
+{
+	if (!test_bit(MSC_TIMESTAMP, input->mscbit))
+		return;
+
+	input_set_timestamp(input, time);
+	input_event(input, EV_MSC, MSC_TIMESTAMP, (u32)ktime_to_us(time));
+}
+
+static void keychron_emit_pending(struct keychron_fast_report *fr)
+{
+	struct keychron_fast_usage *fu;
+	unsigned int i;
+
+	for (i = 0; i < fr->num_usages; i++) {
+		fu = &fr->usages[i];
+		if (!fu->pending)
+			continue;
+		keychron_fast_event(fr->input, fu->usage, fu->pending);
+		fu->pending = 0;
+	}
+}
+
+/* Send the coalesced deltas as one frame. Caller holds kin->lock. */
+static void keychron_flush_input(struct keychron_input *kin, ktime_t now)
+{
+	struct keychron_fast_report *fr = kin->pending;
+
+	kin->last_flush = now;
+	if (!fr)
+		return;
+
+	kin->pending = NULL;
+	keychron_emit_pending(fr);
+	keychron_stamp_frame(fr->input, kin->pending_time);
+	input_sync(fr->input);
+}
+
+static enum hrtimer_restart keychron_flush_timer(struct hrtimer *timer)
+{
+	struct keychron_input *kin = container_of(timer, struct keychron_input,
+						  flush_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&kin->lock, flags);
+	if (!kin->stopped)
+		keychron_flush_input(kin, ktime_get());
+	spin_unlock_irqrestore(&kin->lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+static ssize_t coalesce_us_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct keychron_device *kdev = hid_get_drvdata(to_hid_device(dev));
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(kdev->input->coalesce_us));
+}
+
+static ssize_t coalesce_us_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct keychron_device *kdev = hid_get_drvdata(to_hid_device(dev));
+	struct keychron_input *kin = kdev->input;
+	unsigned long flags;
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+	if (val > KEYCHRON_COALESCE_MAX_US)
+		return -EINVAL;
+
+	spin_lock_irqsave(&kin->lock, flags);
+	keychron_flush_input(kin, ktime_get());
+	kin->coalesce_us = val;
+	spin_unlock_irqrestore(&kin->lock, flags);
+
+	return count;
+}
+static DEVICE_ATTR_RW(coalesce_us);
+
+static struct attribute *keychron_input_attrs[] = {
+	&dev_attr_coalesce_us.attr,
+	NULL
+};
+
+/*
+ * Created by the driver core once probe has succeeded and before the
+ * bind uevent, so udev rules can rely on it. Only interfaces that got a
+ * fast input path show it.
+ */
+static umode_t keychron_input_attr_visible(struct kobject *kobj,
+					   struct attribute *attr, int n)
+{
+	struct keychron_device *kdev =
+		hid_get_drvdata(to_hid_device(kobj_to_dev(kobj)));
+
+	return kdev && kdev->input ? attr->mode : 0;
+}
+
+static const struct attribute_group keychron_input_group = {
+	.attrs = keychron_input_attrs,
+	.is_visible = keychron_input_attr_visible,
+};
+
+static const struct attribute_group *keychron_input_groups[] = {
+	&keychron_input_group,
+	NULL
+};
+
+static void keychron_init_fast_input(struct keychron_device *kdev)
+{
+	struct hid_device *hdev = kdev->hdev;
+	struct hid_report_enum *re = &hdev->report_enum[HID_INPUT_REPORT];
+	struct keychron_input *kin;
+	struct keychron_fast_report *fr;
+	struct hid_report *report;
+
+	/* hiddev readers would miss the field values hid-core stores */
+	if (!fast_input || !(hdev->claimed & HID_CLAIMED_INPUT) ||
+	    (hdev->claimed & HID_CLAIMED_HIDDEV))
+		return;
+
+	kin = devm_kzalloc(&hdev->dev, sizeof(*kin), GFP_KERNEL);
+	if (!kin)
+		return;
+
+	list_for_each_entry(report, &re->report_list, list) {
+		if (kin->num_reports == KEYCHRON_FAST_REPORTS_MAX)
+			break;
+		fr = keychron_build_fast_report(hdev, report);
+		if (fr)
+			kin->reports[kin->num_reports++] = fr;
+	}
+
+	if (!kin->num_reports) {
+		devm_kfree(&hdev->dev, kin);
+		return;
+	}
+
+	spin_lock_init(&kin->lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&kin->flush_timer, keychron_flush_timer, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_ABS);
+#else
+	hrtimer_init(&kin->flush_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	kin->flush_timer.function = keychron_flush_timer;
+#endif
+
+	WRITE_ONCE(kdev->input, kin);
+	hid_dbg(hdev, "fast input path for %u report(s)\n", kin->num_reports);
+}
+
+/* Returns true if the report was consumed */
+static bool keychron_fast_decode(struct hid_device *hdev,
+				 struct keychron_input *kin,
+				 struct keychron_fast_report *fr,
+				 u8 *data, int size, ktime_t now)
+{
+	struct keychron_fast_usage *fu;
+	struct hid_usage *usage;
+	unsigned long flags;
+	u8 *cdata = data;
+	int csize = size;
+	unsigned int i;
+	bool coalesce;
+	bool flush;
+	s32 value;
+
+	if (hdev->report_enum[HID_INPUT_REPORT].numbered) {
+		cdata++;
+		csize--;
+	}
+
+	/* Short reports are zero-padded by hid-core, leave them to it */
+	if (csize < (int)fr->len)
+		return false;
+
+	spin_lock_irqsave(&kin->lock, flags);
+
+	coalesce = kin->coalesce_us && !kin->stopped;
+
+	/* Deltas of another report can't be merged into this one */
+	if (kin->pending && kin->pending != fr)
+		keychron_flush_input(kin, now);
+
+	flush = !coalesce ||
+		ktime_us_delta(now, kin->last_flush) >= kin->coalesce_us;
+
+	for (i = 0; i < fr->num_usages; i++) {
+		fu = &fr->usages[i];
+		usage = fu->usage;
+
+		value = hid_field_extract(hdev, cdata, fu->offset, fu->size);
+		if (fu->is_signed)
+			value = sign_extend32(value, fu->size - 1);
+
+		if (fu->ranged && (value < fu->logical_minimum ||
+				   value > fu->logical_maximum))
+			continue;
+
+		if (coalesce && usage->type == EV_REL) {
+			if (value) {
+				fu->pending += value;
+				kin->pending = fr;
+				kin->pending_time = now;
+			}
+			continue;
+		}
+
+		/* Button edges are never held back */
+		if (usage->type == EV_KEY &&
+		    !!test_bit(usage->code, fr->input->key) != !!value)
+			flush = true;
+
+		keychron_fast_event(fr->input, usage, value);
+	}
+
+	if (flush) {
+		/* Anything held back goes out in this report's frame */
+		if (kin->pending) {
+			keychron_emit_pending(fr);
+			kin->pending = NULL;
+		}
+		kin->last_flush = now;
+		keychron_stamp_frame(fr->input, now);
+		input_sync(fr->input);
+		hrtimer_try_to_cancel(&kin->flush_timer);
+	} else if (kin->pending && !hrtimer_active(&kin->flush_timer)) {
+		hrtimer_start(&kin->flush_timer,
+			      ktime_add_us(kin->last_flush, kin->coalesce_us),
+			      HRTIMER_MODE_ABS);
+	}
+
+	spin_unlock_irqrestore(&kin->lock, flags);
+
+	if (hdev->claimed & HID_CLAIMED_HIDRAW)
+		hidraw_report_event(hdev, data, size);
+
+	return true;
+}
+
+static void keychron_stop_fast_input(struct keychron_device *kdev)
+{
+	struct keychron_input *kin = kdev->input;
+	unsigned long flags;
+
+	if (!kin)
+		return;
+
+	/* Input devices go away with hid_hw_stop(), stop flushing to them */
+	spin_lock_irqsave(&kin->lock, flags);
+	kin->stopped = true;
+	kin->pending = NULL;
+	spin_unlock_irqrestore(&kin->lock, flags);
+
+	hrtimer_cancel(&kin->flush_timer);
+}
+
+static void keychron_record_interval(struct keychron_interval_stats *st,
+				     ktime_t now)
+{
+	unsigned long flags;
+	s64 gap;
+	s64 missed;
+
+	spin_lock_irqsave(&st->lock, flags);
+
+	st->reports++;
+	if (st->last) {
+		gap = ktime_us_delta(now, st->last);
+		st->hist[min_t(int, fls64(gap), KEYCHRON_HIST_BUCKETS - 1)]++;
+		st->max_gap_us = max(st->max_gap_us, gap);
+
+		/* Round to whole polling intervals, one of them is this report */
+		missed = div_s64(gap + st->expected_us / 2, st->expected_us) - 1;
+		if (missed > 0 && missed < KEYCHRON_IDLE_INTERVALS)
+			st->dropped += missed;
+	}
+	st->last = now;
+
+	spin_unlock_irqrestore(&st->lock, flags);
+}
+
+/* Print a log2(us) histogram, one "range count" line per bucket */
+static void keychron_seq_hist(struct seq_file *m, const u64 *hist,
+			      int buckets)
+{
+	int i;
+
+	for (i = 0; i < buckets; i++) {
+		if (!i)
+			seq_printf(m, "<1 %llu\n", hist[i]);
+		else if (i == buckets - 1)
+			seq_printf(m, ">=%u %llu\n", 1U << (i - 1), hist[i]);
+		else
+			seq_printf(m, "%u-%u %llu\n", 1U << (i - 1),
+				   (1U << i) - 1, hist[i]);
+	}
+}
+
+static int keychron_intervals_show(struct seq_file *m, void *unused)
+{
+	struct keychron_interval_stats *st = m->private;
+	u64 hist[KEYCHRON_HIST_BUCKETS];
+	unsigned long flags;
+	u64 reports;
+	u64 dropped;
+	s64 max_gap;
+
+	spin_lock_irqsave(&st->lock, flags);
+	memcpy(hist, st->hist, sizeof(hist));
+	reports = st->reports;
+	dropped = st->dropped;
+	max_gap = st->max_gap_us;
+	spin_unlock_irqrestore(&st->lock, flags);
+
+	seq_printf(m, "reports: %llu\n", reports);
+	seq_printf(m, "expected_interval_us: %u\n", st->expected_us);
+	seq_printf(m, "max_gap_us: %lld\n", max_gap);
+	seq_printf(m, "dropped_estimate: %llu\n", dropped);
+	seq_puts(m, "interval_us count\n");
+	keychron_seq_hist(m, hist, KEYCHRON_HIST_BUCKETS);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(keychron_intervals);
+
+static int keychron_queries_show(struct seq_file *m, void *unused)
+{
+	struct keychron_link *link = m->private;
+	struct keychron_query_stats *st = &link->stats;
+	u64 hist[KEYCHRON_RTT_BUCKETS];
+	u64 queries, failed, attempts, timeouts;
+
+	spin_lock(&st->lock);
+	memcpy(hist, st->rtt_hist, sizeof(hist));
+	queries = st->queries;
+	failed = st->failed;
+	attempts = st->attempts;
+	timeouts = st->timeouts;
+	spin_unlock(&st->lock);
+
+	seq_printf(m, "queries: %llu\n", queries);
+	seq_printf(m, "failed: %llu\n", failed);
+	seq_printf(m, "attempts: %llu\n", attempts);
+	seq_printf(m, "timeouts: %llu\n", timeouts);
+	seq_printf(m, "smoothed_rtt_us: %lld\n", READ_ONCE(link->rtt_us));
+	seq_printf(m, "probe_us: %lld\n", st->probe_us);
+	seq_puts(m, "rtt_us count\n");
+	keychron_seq_hist(m, hist, KEYCHRON_RTT_BUCKETS);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(keychron_queries);
+
+/*
+ * Run a battery poll now and return once it is done, so that benchmarks
+ * needn't wait out the poll interval between queries.
+ */
+static ssize_t keychron_poll_write(struct file *file, const char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct keychron_link *link = file->private_data;
+	struct keychron_battery *kbat = link->kbat;
+
+	mod_delayed_work(system_wq, &kbat->battery_work, 0);
+	flush_delayed_work(&kbat->battery_work);
+
+	return count;
+}
+
+static const struct file_operations keychron_poll_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = keychron_poll_write,
+	.llseek = noop_llseek,
+};
+
+static ssize_t keychron_reset_write(struct file *file,
+				    const char __user *buf, size_t count,
+				    loff_t *ppos)
+{
+	struct keychron_interval_stats *st = file->private_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&st->lock, flags);
+	st->last = 0;
+	st->reports = 0;
+	memset(st->hist, 0, sizeof(st->hist));
+	st->dropped = 0;
+	st->max_gap_us = 0;
+	spin_unlock_irqrestore(&st->lock, flags);
+
+	return count;
+}
+
+static const struct file_operations keychron_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = keychron_reset_write,
+	.llseek = noop_llseek,
+};
+
+/*
+ * The interface's debugfs directory, created on first use so that only
+ * interfaces publishing something get one. Only called once nothing in
+ * probe can fail any more; remove() takes it down.
+ */
+static struct dentry *keychron_debugfs_dir(struct keychron_device *kdev)
+{
+	if (!kdev->debugfs)
+		kdev->debugfs = debugfs_create_dir(dev_name(&kdev->hdev->dev),
+						   keychron_debugfs_root);
+	return kdev->debugfs;
+}
+
+static void keychron_init_interval_stats(struct keychron_device *kdev)
+{
+	struct hid_device *hdev = kdev->hdev;
+	struct usb_interface *intf = to_usb_interface(hdev->dev.parent);
+	struct keychron_interval_stats *st;
+	int ep_addr;
+	int interval;
+
+	if (!(hdev->claimed & HID_CLAIMED_INPUT) ||
+	    keychron_find_intr_endpoint(intf, &ep_addr, &interval))
+		return;
+
+	st = devm_kzalloc(&hdev->dev, sizeof(*st), GFP_KERNEL);
+	if (!st)
+		return;
+
+	spin_lock_init(&st->lock);
+	st->expected_us = keychron_interval_us(interface_to_usbdev(intf),
+					       interval);
+
+	debugfs_create_file("intervals", 0444, keychron_debugfs_dir(kdev), st,
+			    &keychron_intervals_fops);
+	debugfs_create_file("reset_intervals", 0200, kdev->debugfs, st,
+			    &keychron_reset_fops);
+
+	WRITE_ONCE(kdev->stats, st);
+}
+
+static void keychron_urbq_complete(struct urb *urb)
+{
+	struct keychron_device *kdev = urb->context;
+	struct keychron_urb_queue *q = kdev->urbq;
+
+	switch (urb->status) {
+	case 0:
+		/* Endpoint completions are given back in order */
+		hid_input_report(kdev->hdev, HID_INPUT_REPORT,
+				 urb->transfer_buffer, urb->actual_length, 1);
+		break;
+	case -ENOENT:
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+	case -EPERM:
+		return;
+	case -ENODEV:
+	case -EPIPE:
+		/*
+		 * A halted endpoint is cleared by usbhid's error recovery,
+		 * which only resubmits its own URB. Ours come back with the
+		 * next system resume; say so rather than shrink silently.
+		 */
+		if (atomic_inc_return(&q->stopped) == 1)
+			hid_warn(kdev->hdev,
+				 "interrupt URB queue stopped (%d) until resume\n",
+				 urb->status);
+		return;
+	default:
+		/*
+		 * Transient errors such as -EPROTO, -EILSEQ or -ETIME on a
+		 * flaky hub. Keep the URB in flight, as usbhid does.
+		 */
+		hid_dbg(kdev->hdev, "queued interrupt URB failed: %d\n",
+			urb->status);
+		break;
+	}
+
+	usb_anchor_urb(urb, &q->anchor);
+	if (usb_submit_urb(urb, GFP_ATOMIC))
+		usb_unanchor_urb(urb);
+}
+
+static void keychron_urbq_submit(struct keychron_device *kdev)
+{
+	struct keychron_urb_queue *q = kdev->urbq;
+	unsigned int i;
+
+	for (i = 0; i < q->count; i++) {
+		usb_anchor_urb(q->urbs[i], &q->anchor);
+		if (usb_submit_urb(q->urbs[i], GFP_NOIO)) {
+			usb_unanchor_urb(q->urbs[i]);
+			break;
+		}
+	}
+}
+
+static void keychron_free_urb_queue(struct keychron_device *kdev)
+{
+	struct keychron_urb_queue *q = kdev->urbq;
+	struct urb *urb;
+	unsigned int i;
+
+	for (i = 0; i < q->count; i++) {
+		urb = q->urbs[i];
+		usb_free_coherent(urb->dev, q->len, urb->transfer_buffer,
+				  urb->transfer_dma);
+		usb_free_urb(urb);
+	}
+	kfree(q);
+	kdev->urbq = NULL;
+}
+
+static void keychron_init_urb_queue(struct keychron_device *kdev)
+{
+	struct hid_device *hdev = kdev->hdev;
+	struct usb_interface *intf = to_usb_interface(hdev->dev.parent);
+	struct usb_device *udev = interface_to_usbdev(intf);
+	struct usb_endpoint_descriptor *ep;
+	struct keychron_urb_queue *q;
+	struct urb *urb;
+	void *buf;
+	dma_addr_t dma;
+
+	if (!intr_queue_depth || !(hdev->claimed & HID_CLAIMED_INPUT) ||
+	    usb_find_int_in_endpoint(intf->cur_altsetting, &ep))
+		return;
+
+	q = kzalloc(sizeof(*q), GFP_KERNEL);
+	if (!q)
+		return;
+
+	init_usb_anchor(&q->anchor);
+	q->len = usb_endpoint_maxp(ep);
+	kdev->urbq = q;
+
+	while (q->count < min(intr_queue_depth, KEYCHRON_URB_QUEUE_MAX)) {
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb)
+			break;
+		buf = usb_alloc_coherent(udev, q->len, GFP_KERNEL, &dma);
+		if (!buf) {
+			usb_free_urb(urb);
+			break;
+		}
+		usb_fill_int_urb(urb, udev,
+				 usb_rcvintpipe(udev, ep->bEndpointAddress),
+				 buf, q->len, keychron_urbq_complete, kdev,
+				 ep->bInterval);
+		urb->transfer_dma = dma;
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		q->urbs[q->count++] = urb;
+	}
+
+	/* Keep usbhid polling too, and its power management in charge */
+	if (!q->count || hid_hw_open(hdev)) {
+		keychron_free_urb_queue(kdev);
+		return;
+	}
+
+	q->running = true;
+	keychron_urbq_submit(kdev);
+	hid_dbg(hdev, "%u extra interrupt URBs queued\n", q->count);
+}
+
+static void keychron_stop_urb_queue(struct keychron_device *kdev)
+{
+	if (!kdev->urbq)
+		return;
+
+	kdev->urbq->running = false;
+	usb_kill_anchored_urbs(&kdev->urbq->anchor);
+	hid_hw_close(kdev->hdev);
+	keychron_free_urb_queue(kdev);
+}
+
+#ifdef CONFIG_PM
+static int keychron_suspend(struct hid_device *hdev, pm_message_t message)
+{
+	struct keychron_device *kdev = hid_get_drvdata(hdev);
+
+	if (kdev && kdev->urbq)
+		usb_kill_anchored_urbs(&kdev->urbq->anchor);
+	return 0;
+}
+
+static int keychron_resume(struct hid_device *hdev)
+{
+	struct keychron_device *kdev = hid_get_drvdata(hdev);
+
+	if (kdev && kdev->urbq && kdev->urbq->running) {
+		atomic_set(&kdev->urbq->stopped, 0);
+		keychron_urbq_submit(kdev);
+	}
+	return 0;
+}
+#endif
+
+static int keychron_raw_event(struct hid_device *hdev,
+			      struct hid_report *report, u8 *data, int size)
+{
+	struct keychron_device *kdev = hid_get_drvdata(hdev);
+	struct keychron_interval_stats *st;
+	struct keychron_input *kin;
+	unsigned int i;
+
+	if (!kdev)
+		return 0;
+
+	kdev->report_time = ktime_get();
+
+	st = READ_ONCE(kdev->stats);
+	if (st)
+		keychron_record_interval(st, kdev->report_time);
+
+	if (kdev->activity)
+		WRITE_ONCE(kdev->activity->last_input, jiffies);
+
+	kin = READ_ONCE(kdev->input);
+	if (!kin)
+		return 0;
+
+	for (i = 0; i < kin->num_reports; i++) {
+		if (kin->reports[i]->report != report)
+			continue;
+		/* A negative return keeps hid-core from parsing it again */
+		if (keychron_fast_decode(hdev, kin, kin->reports[i], data,
+					 size, kdev->report_time))
+			return -1;
+		break;
+	}
+	return 0;
+}
+
+/* Generic path: runs after hid-core's field processing, before the sync */
+static void keychron_report(struct hid_device *hdev, struct hid_report *report)
+{
+	struct keychron_device *kdev = hid_get_drvdata(hdev);
+
+	if (!kdev || !report->maxfield || !report->field[0]->hidinput)
+		return;
+
+	keychron_stamp_frame(report->field[0]->hidinput->input,
+			     kdev->report_time);
+}
+
+static int keychron_input_configured(struct hid_device *hdev,
+				     struct hid_input *hi)
+{
+	/* Mouse motion only, not the keyboard or consumer control inputs */
+	if (test_bit(EV_REL, hi->input->evbit) &&
+	    test_bit(REL_X, hi->input->relbit))
+		input_set_capability(hi->input, EV_MSC, MSC_TIMESTAMP);
+	return 0;
 }
 
 static int keychron_probe(struct hid_device *hdev,
 			  const struct hid_device_id *id)
 {
 	struct keychron_device *kdev;
+	struct keychron_link *link;
 	struct usb_interface *intf;
-	struct power_supply_config psy_cfg = {};
+	enum keychron_link_type type;
+	ktime_t start = ktime_get();
+	bool cached;
 	int ret;
 	int battery;
 
@@ -301,10 +2317,6 @@ static int keychron_probe(struct hid_device *hdev,
 		return -ENOMEM;
 
 	kdev->hdev = hdev;
-	kdev->battery_capacity = 0;
-	kdev->owns_battery = false;
-	init_completion(&kdev->response_received);
-	atomic_set(&kdev->waiting_response, 0);
 	hid_set_drvdata(hdev, kdev);
 
 	ret = hid_parse(hdev);
@@ -325,96 +2337,135 @@ static int keychron_probe(struct hid_device *hdev,
 		return ret;
 
 	/* Only handle battery on the vendor interface */
-	if (!keychron_is_vendor_interface(hdev))
-		return 0;
-
-	mutex_lock(&keychron_battery_mutex);
-	if (keychron_battery_owner) {
-		mutex_unlock(&keychron_battery_mutex);
+	if (!keychron_is_vendor_interface(hdev)) {
+		keychron_init_fast_input(kdev);
+		/* The rest needs a USB interface, which uhid devices lack */
+		if (!hid_is_usb(hdev))
+			return 0;
+		keychron_init_interval_stats(kdev);
+		keychron_init_urb_queue(kdev);
+		intf = to_usb_interface(hdev->dev.parent);
+		kdev->activity = keychron_get_activity(interface_to_usbdev(intf));
 		return 0;
 	}
-	keychron_battery_owner = kdev;
-	kdev->owns_battery = true;
-	mutex_unlock(&keychron_battery_mutex);
+
+	type = id->product == USB_DEVICE_ID_KEYCHRON_M5 ?
+	       KEYCHRON_LINK_WIRED : KEYCHRON_LINK_WIRELESS;
+
+	link = kzalloc(sizeof(*link), GFP_KERNEL);
+	if (!link)
+		return -ENOMEM;
+
+	link->hdev = hdev;
+	link->type = type;
+	init_completion(&link->response_received);
+	init_completion(&link->ctrl_done);
+	init_waitqueue_head(&link->abort_wait);
+	atomic_set(&link->waiting_response, 0);
+	spin_lock_init(&link->cmd_lock);
+	spin_lock_init(&link->stats.lock);
+	INIT_LIST_HEAD(&link->cmd_queue);
+	INIT_WORK(&link->cmd_work, keychron_cmd_work);
 
 	/* Get USB device and interface */
 	intf = to_usb_interface(hdev->dev.parent);
-	kdev->intf = intf;
-	kdev->udev = usb_get_dev(interface_to_usbdev(intf));
+	link->intf = intf;
+	link->udev = usb_get_dev(interface_to_usbdev(intf));
+	link->activity = keychron_get_activity(link->udev);
 
 	/* Find interrupt endpoint */
-	ret = keychron_find_intr_endpoint(intf, &kdev->intr_ep,
-					  &kdev->intr_interval);
+	ret = keychron_find_intr_endpoint(intf, &link->intr_ep,
+					  &link->intr_interval);
 	if (ret) {
 		hid_err(hdev, "no interrupt endpoint found\n");
-		goto err_cleanup;
+		goto err_free_link;
 	}
 
-	/* Allocate URB and buffer */
-	kdev->intr_urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!kdev->intr_urb) {
+	/* Allocate URBs and buffers */
+	link->intr_urb = usb_alloc_urb(0, GFP_KERNEL);
+	link->ctrl_urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!link->intr_urb || !link->ctrl_urb) {
 		ret = -ENOMEM;
-		goto err_cleanup;
+		goto err_free_link;
 	}
 
-	kdev->intr_buf = kmalloc(KEYCHRON_REPORT_SIZE, GFP_KERNEL);
-	if (!kdev->intr_buf) {
+	link->intr_buf = kmalloc(KEYCHRON_REPORT_SIZE, GFP_KERNEL);
+	link->cmd_buf = kmalloc(KEYCHRON_REPORT_SIZE, GFP_KERNEL);
+	link->ctrl_req = kmalloc(sizeof(*link->ctrl_req), GFP_KERNEL);
+	if (!link->intr_buf || !link->cmd_buf || !link->ctrl_req) {
 		ret = -ENOMEM;
-		goto err_cleanup;
+		goto err_free_link;
 	}
 
-	/* Test battery query */
-	battery = keychron_query_battery(kdev);
+	/*
+	 * A device seen recently publishes its last known value immediately
+	 * and is refreshed in the background; anything else gets a blocking
+	 * test query.
+	 */
+	battery = keychron_cache_take(link);
+	cached = battery >= 0;
+	if (!cached)
+		battery = keychron_query_battery(link);
 	if (battery < 0) {
 		hid_info(hdev, "battery query failed (%d), device may not support battery reporting\n",
 			 battery);
 		ret = 0; /* Don't fail probe, just skip battery */
-		goto err_cleanup;
-	}
-
-	kdev->battery_capacity = battery;
-
-	/* Register power supply */
-	kdev->battery_desc.name = "keychron_mouse";
-	kdev->battery_desc.type = POWER_SUPPLY_TYPE_BATTERY;
-	kdev->battery_desc.properties = keychron_battery_props;
-	kdev->battery_desc.num_properties = ARRAY_SIZE(keychron_battery_props);
-	kdev->battery_desc.get_property = keychron_battery_get_property;
-
-	psy_cfg.drv_data = kdev;
-
-	kdev->battery = power_supply_register(&hdev->dev, &kdev->battery_desc,
-					      &psy_cfg);
-	if (IS_ERR(kdev->battery)) {
-		ret = PTR_ERR(kdev->battery);
-		hid_err(hdev, "failed to register power supply: %d\n", ret);
-		goto err_cleanup;
+		goto err_free_link;
 	}
 
-	INIT_DELAYED_WORK(&kdev->battery_work, keychron_battery_work);
-	schedule_delayed_work(&kdev->battery_work,
-			      msecs_to_jiffies(KEYCHRON_POLL_INTERVAL_MS));
-
-	hid_info(hdev, "Keychron mouse battery: %d%%\n", battery);
+	ret = keychron_attach_link(link, battery, cached);
+	if (ret)
+		goto err_free_link;
+
+	kdev->link = link;
+	link->stats.probe_us = ktime_us_delta(ktime_get(), start);
+	debugfs_create_file("queries", 0444, keychron_debugfs_dir(kdev), link,
+			    &keychron_queries_fops);
+	debugfs_create_file("poll", 0200, kdev->debugfs, link,
+			    &keychron_poll_fops);
+	keychron_init_faults(link, kdev->debugfs);
+
+	hid_info(hdev, "Keychron mouse battery %s: %d%% (%s%s)\n",
+		 link->kbat->name, battery,
+		 type == KEYCHRON_LINK_WIRED ? "wired" : "wireless",
+		 cached ? ", cached" : "");
 	return 0;
 
-err_cleanup:
-	keychron_cleanup_battery(kdev);
+err_free_link:
+	keychron_free_link(link);
 	return ret;
 }
 
 static void keychron_remove(struct hid_device *hdev)
 {
 	struct keychron_device *kdev = hid_get_drvdata(hdev);
+	ktime_t start = ktime_get();
+
+	/* Statistics files point into the link and input state freed below */
+	if (kdev)
+		debugfs_remove_recursive(kdev->debugfs);
 
-	if (kdev && kdev->owns_battery) {
-		cancel_delayed_work_sync(&kdev->battery_work);
-		usb_kill_urb(kdev->intr_urb);
-		power_supply_unregister(kdev->battery);
-		keychron_cleanup_battery(kdev);
+	if (kdev && kdev->link) {
+		/* Cut short any query in flight before waiting on it */
+		keychron_cmd_abort(kdev->link);
+		keychron_detach_link(kdev->link);
+		keychron_free_link(kdev->link);
+	}
+
+	if (kdev) {
+		keychron_stop_urb_queue(kdev);
+		keychron_stop_fast_input(kdev);
 	}
 
 	hid_hw_stop(hdev);
+
+	if (kdev) {
+		/* raw_event may stamp it until hid_hw_stop() returns */
+		keychron_put_activity(kdev->activity);
+	}
+
+	hid_dbg(hdev, "removed in %lld us\n",
+		ktime_us_delta(ktime_get(), start));
 }
 
 static const struct hid_device_id keychron_devices[] = {
@@ -429,8 +2480,50 @@ static struct hid_driver keychron_driver = {
 	.id_table = keychron_devices,
 	.probe = keychron_probe,
 	.remove = keychron_remove,
+	.raw_event = keychron_raw_event,
+	.report = keychron_report,
+	.input_configured = keychron_input_configured,
+	.driver = {
+		.dev_groups = keychron_input_groups,
+	},
+#ifdef CONFIG_PM
+	.suspend = keychron_suspend,
+	.resume = keychron_resume,
+	.reset_resume = keychron_resume,
+#endif
 };
-module_hid_driver(keychron_driver);
+
+static int __init keychron_init(void)
+{
+	int ret;
+
+	sema_init(&keychron_query_sem, max(max_inflight, 1U));
+
+	keychron_cmd_wq = alloc_workqueue("keychron_cmd", WQ_UNBOUND,
+					  max(max_inflight, 1U));
+	if (!keychron_cmd_wq)
+		return -ENOMEM;
+
+	keychron_debugfs_root = debugfs_create_dir("keychron", NULL);
+
+	ret = hid_register_driver(&keychron_driver);
+	if (ret) {
+		debugfs_remove_recursive(keychron_debugfs_root);
+		destroy_workqueue(keychron_cmd_wq);
+	}
+	return ret;
+}
+
+static void __exit keychron_exit(void)
+{
+	hid_unregister_driver(&keychron_driver);
+	keychron_cache_clear();
+	debugfs_remove_recursive(keychron_debugfs_root);
+	destroy_workqueue(keychron_cmd_wq);
+}
+
+module_init(keychron_init);
+module_exit(keychron_exit);
 
 MODULE_AUTHOR("Chris Sutcliff <chris@sutcliff.me>");
 MODULE_DESCRIPTION("HID driver for Keychron mouse battery reporting");
@@ -0,0 +1,430 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KUnit tests for the Keychron mouse vendor protocol
+ *
+ * Copyright (c) 2026 Chris Sutcliff <chris@sutcliff.me>
+ *
+ * Exercises response matching, status parsing and the query retry loop
+ * from keychron_protocol.h with synthetic reports and scripted fake
+ * transports, so no mouse is needed. One of them models the vendor
+ * interface's endpoint: reports reach keychron_response_action(), the
+ * decision keychron_urb_complete() makes, inside or after each attempt's
+ * window, so late and duplicate responses go through the same code as on
+ * the wire. Built alongside the driver with "make KUNIT=1".
+ */
+
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/string.h>
+
+#include "keychron_protocol.h"
+
+#define FAKE_MAX_STEPS	4
+
+/* What the fake transport answers on one attempt */
+struct fake_step {
+	int ret;		/* response length, or negative errno */
+	u8 id;			/* report ID of the response */
+	u8 cmd;			/* command echo */
+	u8 battery;
+};
+
+struct fake_transport {
+	struct fake_step steps[FAKE_MAX_STEPS];
+	int transfers;
+	int backoffs;
+	int last_backoff;
+};
+
+static int fake_transfer(void *ctx, u8 *resp, int size)
+{
+	struct fake_transport *ft = ctx;
+	struct fake_step *step = &ft->steps[ft->transfers++];
+
+	if (step->ret < 0)
+		return step->ret;
+
+	memset(resp, 0, size);
+	resp[0] = step->id;
+	resp[1] = step->cmd;
+	resp[KEYCHRON_BATTERY_OFFSET] = step->battery;
+	return step->ret;
+}
+
+static void fake_backoff(void *ctx, int attempt)
+{
+	struct fake_transport *ft = ctx;
+
+	ft->backoffs++;
+	ft->last_backoff = attempt;
+}
+
+static const struct keychron_query_ops fake_ops = {
+	.transfer = fake_transfer,
+	.backoff = fake_backoff,
+};
+
+#define GOOD(level) \
+	{ KEYCHRON_REPORT_SIZE, KEYCHRON_REPORT_ID_RESP, KEYCHRON_CMD_STATUS, (level) }
+
+static void status_report(u8 *buf, u8 level)
+{
+	memset(buf, 0, KEYCHRON_REPORT_SIZE);
+	buf[0] = KEYCHRON_REPORT_ID_RESP;
+	buf[1] = KEYCHRON_CMD_STATUS;
+	buf[KEYCHRON_BATTERY_OFFSET] = level;
+}
+
+static void keychron_test_parse_status(struct kunit *test)
+{
+	u8 buf[KEYCHRON_REPORT_SIZE];
+
+	status_report(buf, 0);
+	KUNIT_EXPECT_EQ(test, keychron_parse_status(buf, sizeof(buf)), 0);
+	status_report(buf, 57);
+	KUNIT_EXPECT_EQ(test, keychron_parse_status(buf, sizeof(buf)), 57);
+	status_report(buf, 100);
+	KUNIT_EXPECT_EQ(test, keychron_parse_status(buf, sizeof(buf)), 100);
+
+	/* Out of range levels */
+	status_report(buf, 101);
+	KUNIT_EXPECT_EQ(test, keychron_parse_status(buf, sizeof(buf)), -EPROTO);
+	status_report(buf, 255);
+	KUNIT_EXPECT_EQ(test, keychron_parse_status(buf, sizeof(buf)), -EPROTO);
+
+	/* Truncated right before and right at the battery byte */
+	status_report(buf, 42);
+	KUNIT_EXPECT_EQ(test,
+			keychron_parse_status(buf, KEYCHRON_BATTERY_OFFSET),
+			-EPROTO);
+	KUNIT_EXPECT_EQ(test,
+			keychron_parse_status(buf, KEYCHRON_BATTERY_OFFSET + 1),
+			42);
+	KUNIT_EXPECT_EQ(test, keychron_parse_status(buf, 0), -EPROTO);
+}
+
+static void keychron_test_response_matches(struct kunit *test)
+{
+	u8 buf[KEYCHRON_REPORT_SIZE];
+
+	status_report(buf, 50);
+	KUNIT_EXPECT_TRUE(test, keychron_response_matches(buf, sizeof(buf),
+							  KEYCHRON_CMD_STATUS));
+	/* Echo of another command */
+	KUNIT_EXPECT_FALSE(test, keychron_response_matches(buf, sizeof(buf),
+							   0x07));
+
+	/* Wrong report IDs, including our own request echoed back */
+	buf[0] = KEYCHRON_REPORT_ID_CMD;
+	KUNIT_EXPECT_FALSE(test, keychron_response_matches(buf, sizeof(buf),
+							   KEYCHRON_CMD_STATUS));
+	buf[0] = 0x01;
+	KUNIT_EXPECT_FALSE(test, keychron_response_matches(buf, sizeof(buf),
+							   KEYCHRON_CMD_STATUS));
+
+	/* Too short to carry the echo */
+	status_report(buf, 50);
+	KUNIT_EXPECT_TRUE(test, keychron_response_matches(buf, 2,
+							  KEYCHRON_CMD_STATUS));
+	KUNIT_EXPECT_FALSE(test, keychron_response_matches(buf, 1,
+							   KEYCHRON_CMD_STATUS));
+	KUNIT_EXPECT_FALSE(test, keychron_response_matches(buf, 0,
+							   KEYCHRON_CMD_STATUS));
+}
+
+static void keychron_test_query_first_try(struct kunit *test)
+{
+	struct fake_transport ft = { .steps = { GOOD(80) } };
+	int attempts;
+
+	KUNIT_EXPECT_EQ(test, keychron_query_status(&fake_ops, &ft, 3,
+						    &attempts), 80);
+	KUNIT_EXPECT_EQ(test, attempts, 1);
+	KUNIT_EXPECT_EQ(test, ft.backoffs, 0);
+}
+
+static void keychron_test_response_action(struct kunit *test)
+{
+	u8 buf[KEYCHRON_REPORT_SIZE];
+
+	status_report(buf, 50);
+	KUNIT_EXPECT_EQ(test, keychron_response_action(buf, sizeof(buf),
+						       KEYCHRON_CMD_STATUS),
+			KEYCHRON_RESP_ACCEPT);
+	/* Nothing waiting: late or duplicate */
+	KUNIT_EXPECT_EQ(test, keychron_response_action(buf, sizeof(buf), -1),
+			KEYCHRON_RESP_STALE);
+	/* Waiting for another command */
+	KUNIT_EXPECT_EQ(test, keychron_response_action(buf, sizeof(buf), 0x07),
+			KEYCHRON_RESP_IGNORE);
+	buf[0] = 0x01;
+	KUNIT_EXPECT_EQ(test, keychron_response_action(buf, sizeof(buf),
+						       KEYCHRON_CMD_STATUS),
+			KEYCHRON_RESP_IGNORE);
+	KUNIT_EXPECT_EQ(test, keychron_response_action(buf, sizeof(buf), -1),
+			KEYCHRON_RESP_STALE);
+}
+
+/*
+ * Reports on the vendor endpoint during one query attempt. @window
+ * arrive while the attempt waits, in order; @late arrive after it gave up
+ * or was answered, before the next attempt starts.
+ */
+#define WIRE_MAX_REPORTS	3
+
+struct wire_report {
+	u8 id;
+	u8 cmd;
+	u8 battery;
+};
+
+struct wire_attempt {
+	struct wire_report window[WIRE_MAX_REPORTS];
+	struct wire_report late[WIRE_MAX_REPORTS];
+};
+
+struct wire_transport {
+	struct wire_attempt attempts[FAKE_MAX_STEPS];
+	int transfers;
+	int accepted;
+	int ignored;
+	int stale;
+};
+
+#define WIRE(level) { KEYCHRON_REPORT_ID_RESP, KEYCHRON_CMD_STATUS, (level) }
+
+/* Offer one report to the endpoint; returns true if it was taken */
+static bool wire_offer(struct wire_transport *wt, const struct wire_report *r,
+		       int waiting_id, u8 *resp)
+{
+	u8 buf[KEYCHRON_REPORT_SIZE];
+
+	memset(buf, 0, sizeof(buf));
+	buf[0] = r->id;
+	buf[1] = r->cmd;
+	buf[KEYCHRON_BATTERY_OFFSET] = r->battery;
+
+	switch (keychron_response_action(buf, sizeof(buf), waiting_id)) {
+	case KEYCHRON_RESP_ACCEPT:
+		wt->accepted++;
+		memcpy(resp, buf, sizeof(buf));
+		return true;
+	case KEYCHRON_RESP_IGNORE:
+		wt->ignored++;
+		break;
+	case KEYCHRON_RESP_STALE:
+		wt->stale++;
+		break;
+	}
+	return false;
+}
+
+static int wire_transfer(void *ctx, u8 *resp, int size)
+{
+	struct wire_transport *wt = ctx;
+	struct wire_attempt *a = &wt->attempts[wt->transfers++];
+	int waiting_id = KEYCHRON_CMD_STATUS;
+	int i;
+
+	for (i = 0; i < WIRE_MAX_REPORTS && a->window[i].id; i++)
+		if (wire_offer(wt, &a->window[i], waiting_id, resp))
+			waiting_id = -1;
+
+	for (i = 0; i < WIRE_MAX_REPORTS && a->late[i].id; i++)
+		wire_offer(wt, &a->late[i], -1, resp);
+
+	return waiting_id < 0 ? KEYCHRON_REPORT_SIZE : -ETIMEDOUT;
+}
+
+static void wire_backoff(void *ctx, int attempt)
+{
+}
+
+static const struct keychron_query_ops wire_ops = {
+	.transfer = wire_transfer,
+	.backoff = wire_backoff,
+};
+
+/* A response after its attempt timed out is dropped before the next */
+static void keychron_test_wire_late_response(struct kunit *test)
+{
+	struct wire_transport wt = {
+		.attempts = {
+			{ .late = { WIRE(70) } },
+			{ .window = { WIRE(71) } },
+		},
+	};
+	int attempts;
+
+	KUNIT_EXPECT_EQ(test, keychron_query_status(&wire_ops, &wt, 3,
+						    &attempts), 71);
+	KUNIT_EXPECT_EQ(test, attempts, 2);
+	KUNIT_EXPECT_EQ(test, wt.stale, 1);
+	KUNIT_EXPECT_EQ(test, wt.accepted, 1);
+}
+
+/*
+ * A response late enough to land in the next attempt's window is taken
+ * as that attempt's answer, and the real answer then counts as stale.
+ */
+static void keychron_test_wire_stale_in_window(struct kunit *test)
+{
+	struct wire_transport wt = {
+		.attempts = {
+			{ },
+			{ .window = { WIRE(70), WIRE(69) } },
+		},
+	};
+	int attempts;
+
+	KUNIT_EXPECT_EQ(test, keychron_query_status(&wire_ops, &wt, 3,
+						    &attempts), 70);
+	KUNIT_EXPECT_EQ(test, attempts, 2);
+	KUNIT_EXPECT_EQ(test, wt.accepted, 1);
+	KUNIT_EXPECT_EQ(test, wt.stale, 1);
+}
+
+/* Duplicates of a response, in the window or after it, are dropped */
+static void keychron_test_wire_duplicates(struct kunit *test)
+{
+	struct wire_transport wt = {
+		.attempts = {
+			{ .window = { WIRE(55), WIRE(55) },
+			  .late = { WIRE(55) } },
+		},
+	};
+	int attempts;
+
+	KUNIT_EXPECT_EQ(test, keychron_query_status(&wire_ops, &wt, 3,
+						    &attempts), 55);
+	KUNIT_EXPECT_EQ(test, attempts, 1);
+	KUNIT_EXPECT_EQ(test, wt.accepted, 1);
+	KUNIT_EXPECT_EQ(test, wt.stale, 2);
+}
+
+/* Unrelated reports in the window don't end the wait */
+static void keychron_test_wire_unrelated(struct kunit *test)
+{
+	struct wire_transport wt = {
+		.attempts = {
+			{ .window = {
+				{ KEYCHRON_REPORT_ID_RESP, 0x07, 12 },
+				{ 0x01, KEYCHRON_CMD_STATUS, 13 },
+				WIRE(44),
+			} },
+		},
+	};
+	int attempts;
+
+	KUNIT_EXPECT_EQ(test, keychron_query_status(&wire_ops, &wt, 3,
+						    &attempts), 44);
+	KUNIT_EXPECT_EQ(test, wt.ignored, 2);
+	KUNIT_EXPECT_EQ(test, wt.accepted, 1);
+}
+
+/* A malformed response in the window is retried like a lost one */
+static void keychron_test_wire_malformed_in_window(struct kunit *test)
+{
+	struct wire_transport wt = {
+		.attempts = {
+			{ .window = { WIRE(150) } },
+			{ .window = { WIRE(60) } },
+		},
+	};
+	int attempts;
+
+	KUNIT_EXPECT_EQ(test, keychron_query_status(&wire_ops, &wt, 3,
+						    &attempts), 60);
+	KUNIT_EXPECT_EQ(test, attempts, 2);
+}
+
+static void keychron_test_query_all_timeouts(struct kunit *test)
+{
+	struct fake_transport ft = {
+		.steps = { { -ETIMEDOUT }, { -ETIMEDOUT }, { -ETIMEDOUT } },
+	};
+	int attempts;
+
+	KUNIT_EXPECT_EQ(test, keychron_query_status(&fake_ops, &ft, 3,
+						    &attempts), -ETIMEDOUT);
+	KUNIT_EXPECT_EQ(test, attempts, 3);
+	KUNIT_EXPECT_EQ(test, ft.transfers, 3);
+	KUNIT_EXPECT_EQ(test, ft.backoffs, 2);
+	KUNIT_EXPECT_EQ(test, ft.last_backoff, 2);
+}
+
+static void keychron_test_query_device_gone(struct kunit *test)
+{
+	struct fake_transport ft = { .steps = { { -EPIPE }, { -ENODEV } } };
+	int attempts;
+
+	KUNIT_EXPECT_EQ(test, keychron_query_status(&fake_ops, &ft, 3,
+						    &attempts), -ENODEV);
+	KUNIT_EXPECT_EQ(test, attempts, 2);
+	KUNIT_EXPECT_EQ(test, ft.backoffs, 1);
+}
+
+static void keychron_test_query_malformed(struct kunit *test)
+{
+	struct fake_transport ft = {
+		.steps = {
+			GOOD(200),	/* corrupted level */
+			{ KEYCHRON_BATTERY_OFFSET, KEYCHRON_REPORT_ID_RESP,
+			  KEYCHRON_CMD_STATUS, 50 },	/* truncated */
+			GOOD(33),
+		},
+	};
+	int attempts;
+
+	KUNIT_EXPECT_EQ(test, keychron_query_status(&fake_ops, &ft, 3,
+						    &attempts), 33);
+	KUNIT_EXPECT_EQ(test, attempts, 3);
+
+	/* Malformed every time: the parse error is what's left */
+	memset(&ft, 0, sizeof(ft));
+	ft.steps[0] = (struct fake_step)GOOD(101);
+	ft.steps[1] = (struct fake_step)GOOD(101);
+	KUNIT_EXPECT_EQ(test, keychron_query_status(&fake_ops, &ft, 2,
+						    &attempts), -EPROTO);
+	KUNIT_EXPECT_EQ(test, attempts, 2);
+}
+
+/* A transport claiming more than the buffer holds is clamped to it */
+static void keychron_test_query_oversized(struct kunit *test)
+{
+	struct fake_transport ft = {
+		.steps = { { 4096, KEYCHRON_REPORT_ID_RESP,
+			     KEYCHRON_CMD_STATUS, 90 } },
+	};
+	int attempts;
+
+	KUNIT_EXPECT_EQ(test, keychron_query_status(&fake_ops, &ft, 3,
+						    &attempts), 90);
+}
+
+static struct kunit_case keychron_protocol_cases[] = {
+	KUNIT_CASE(keychron_test_parse_status),
+	KUNIT_CASE(keychron_test_response_matches),
+	KUNIT_CASE(keychron_test_response_action),
+	KUNIT_CASE(keychron_test_query_first_try),
+	KUNIT_CASE(keychron_test_query_all_timeouts),
+	KUNIT_CASE(keychron_test_query_device_gone),
+	KUNIT_CASE(keychron_test_query_malformed),
+	KUNIT_CASE(keychron_test_query_oversized),
+	KUNIT_CASE(keychron_test_wire_late_response),
+	KUNIT_CASE(keychron_test_wire_stale_in_window),
+	KUNIT_CASE(keychron_test_wire_duplicates),
+	KUNIT_CASE(keychron_test_wire_unrelated),
+	KUNIT_CASE(keychron_test_wire_malformed_in_window),
+	{}
+};
+
+static struct kunit_suite keychron_protocol_suite = {
+	.name = "keychron_protocol",
+	.test_cases = keychron_protocol_cases,
+};
+kunit_test_suite(keychron_protocol_suite);
+
+MODULE_AUTHOR("Chris Sutcliff <chris@sutcliff.me>");
+MODULE_DESCRIPTION("KUnit tests for the Keychron mouse vendor protocol");
+MODULE_LICENSE("GPL");
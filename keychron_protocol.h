@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Keychron mouse vendor protocol
+ *
+ * Copyright (c) 2026 Chris Sutcliff <chris@sutcliff.me>
+ *
+ * Report layout and response decoding, kept free of kernel-only
+ * dependencies so that the exact code the driver runs can also be built
+ * into userspace tools against captured reports.
+ */
+
+#ifndef KEYCHRON_PROTOCOL_H
+#define KEYCHRON_PROTOCOL_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/errno.h>
+#else
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+
+typedef uint8_t u8;
+#endif
+
+#define KEYCHRON_REPORT_ID_CMD		0xB3
+#define KEYCHRON_REPORT_ID_RESP		0xB4
+#define KEYCHRON_CMD_STATUS		0x06
+#define KEYCHRON_BATTERY_OFFSET		20
+#define KEYCHRON_REPORT_SIZE		64
+
+/*
+ * Whether an interrupt report is the response to command @id: report ID
+ * 0xB4 and the echo of the command on the wire.
+ */
+static inline bool keychron_response_matches(const u8 *data, int len, u8 id)
+{
+	return len >= 2 && data[0] == KEYCHRON_REPORT_ID_RESP && data[1] == id;
+}
+
+/*
+ * What to do with an interrupt report from the vendor interface. Only a
+ * report arriving while a command waits, with that command's echo, is
+ * its response; anything else while waiting is unrelated and listening
+ * goes on. Once nothing waits, because the response was already taken or
+ * the attempt timed out, a report is stale and is dropped.
+ *
+ * The protocol has no sequence number, so a late response to one attempt
+ * that arrives inside the next attempt's window is taken as that
+ * attempt's answer. For status queries that only means a reading a few
+ * hundred milliseconds old; the real answer then arrives as a stale
+ * duplicate.
+ */
+enum keychron_resp_action {
+	KEYCHRON_RESP_ACCEPT,
+	KEYCHRON_RESP_IGNORE,
+	KEYCHRON_RESP_STALE,
+};
+
+/* @waiting_id is the ID of the command waiting for a response, or -1 */
+static inline enum keychron_resp_action
+keychron_response_action(const u8 *data, int len, int waiting_id)
+{
+	if (waiting_id < 0)
+		return KEYCHRON_RESP_STALE;
+	if (!keychron_response_matches(data, len, waiting_id))
+		return KEYCHRON_RESP_IGNORE;
+	return KEYCHRON_RESP_ACCEPT;
+}
+
+/*
+ * Extract the battery level from a status response of @len bytes,
+ * report ID included. Returns 0-100 or -EPROTO.
+ */
+static inline int keychron_parse_status(const u8 *data, int len)
+{
+	if (len < KEYCHRON_BATTERY_OFFSET + 1 ||
+	    data[KEYCHRON_BATTERY_OFFSET] > 100)
+		return -EPROTO;
+
+	return data[KEYCHRON_BATTERY_OFFSET];
+}
+
+/*
+ * Transport hooks for keychron_query_status(). @transfer puts one status
+ * request on the wire and copies the response, report ID included, into
+ * @resp; it returns the response length or a negative errno. @backoff
+ * waits before retry number @attempt, counting from 1.
+ */
+struct keychron_query_ops {
+	int (*transfer)(void *ctx, u8 *resp, int size);
+	void (*backoff)(void *ctx, int attempt);
+};
+
+/*
+ * Query the battery level with up to @retries transfers in total. Errors
+ * and malformed responses are retried, except -ENODEV, which means the
+ * device is gone. Returns 0-100 or the last error, and stores the number
+ * of transfers made in @attempts.
+ */
+static inline int keychron_query_status(const struct keychron_query_ops *ops,
+					void *ctx, int retries, int *attempts)
+{
+	u8 resp[KEYCHRON_REPORT_SIZE];
+	int ret = -EINVAL;
+	int i = 0;
+
+	while (i < retries) {
+		if (i)
+			ops->backoff(ctx, i);
+
+		ret = ops->transfer(ctx, resp, sizeof(resp));
+		i++;
+		if (ret > (int)sizeof(resp))
+			ret = sizeof(resp);
+		if (ret >= 0)
+			ret = keychron_parse_status(resp, ret);
+		if (ret >= 0 || ret == -ENODEV)
+			break;
+	}
+
+	*attempts = i;
+	return ret;
+}
+
+#endif /* KEYCHRON_PROTOCOL_H */
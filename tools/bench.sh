@@ -0,0 +1,254 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Benchmark harness for the keychron_battery driver
+#
+# Drives the driver against tools/keychron-emu on dummy_hcd and prints one
+# JSON object on stdout:
+#
+#   probe    over -c plug-ins of the emulated receiver: time from its
+#            connect and from the end of its enumeration (SET_CONFIGURATION)
+#            to the power supply's uevent, and the driver's own probe to
+#            registration time. Every plug-in uses a new serial number, so
+#            each is a cold probe with a blocking query rather than one
+#            served from the driver's battery cache.
+#   queries  over -n polls forced through debugfs: round-trip percentiles
+#            from the driver's per-attempt debug messages, attempts and
+#            retries per successful query, and kworker CPU time per query,
+#            net of an idle baseline of the same length.
+#
+# Needs root, tools/keychron-emu (make tools), udevadm, debugfs and a
+# kernel with dummy_hcd and raw_gadget. Runs on a dummy_hcd bus of its
+# own; other devices are left alone.
+#
+# Usage: bench.sh [-c cycles] [-n queries] [-l latency_ms[:jitter_ms]]
+#                 [-L loss_pct] [-d udc_device]
+#   e.g. bench.sh -c 20 -n 2000 -l 8:4 -L 10 > results.json
+
+set -u
+
+cycles=10
+queries=1000
+latency=8:4
+loss=0
+udc=dummy_udc.0
+
+usage() {
+	echo "Usage: $0 [-c cycles] [-n queries] [-l latency_ms[:jitter_ms]] [-L loss_pct] [-d udc_device]" >&2
+	exit 2
+}
+
+while getopts "c:n:l:L:d:" opt; do
+	case $opt in
+	c) cycles=$OPTARG ;;
+	n) queries=$OPTARG ;;
+	l) latency=$OPTARG ;;
+	L) loss=$OPTARG ;;
+	d) udc=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 0 ] || usage
+
+emu=$(dirname "$0")/keychron-emu
+debugfs=/sys/kernel/debug
+tmp=$(mktemp -d)
+emu_pid=
+udev_pid=
+
+if [ "$(id -u)" -ne 0 ]; then
+	echo "must run as root" >&2
+	exit 1
+fi
+if [ ! -x "$emu" ]; then
+	echo "$emu not built, run make tools" >&2
+	exit 1
+fi
+
+cleanup() {
+	[ -n "$emu_pid" ] && kill "$emu_pid" 2>/dev/null
+	[ -n "$udev_pid" ] && kill "$udev_pid" 2>/dev/null
+	wait 2>/dev/null
+	rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+modprobe dummy_hcd && modprobe raw_gadget && modprobe keychron_battery || exit 1
+
+# Nearest-rank percentiles of the numbers on stdin, as JSON members
+percentiles() {
+	sort -n | awk '
+		{ v[NR] = $1 }
+		function pct(p,  r) {
+			r = NR * p / 100
+			r = r == int(r) ? r : int(r) + 1
+			return v[r > 0 ? r : 1]
+		}
+		END {
+			if (!NR) {
+				printf "\"count\": 0"
+				exit
+			}
+			printf "\"count\": %d, \"p50\": %d, \"p99\": %d, \"p999\": %d, \"max\": %d",
+			       NR, pct(50), pct(99), pct(99.9), v[NR]
+		}'
+}
+
+# "key: value" from the driver's queries file
+stat_value() {
+	awk -v key="$2:" '$1 == key { print $2 }' "$1"
+}
+
+# CPU time of every kworker so far, in ns
+kworker_cpu_ns() {
+	local sum=0 comm t d
+
+	for d in /proc/[0-9]*; do
+		read -r comm < "$d/comm" 2>/dev/null || continue
+		[[ $comm == kworker* ]] || continue
+		read -r t _ < "$d/schedstat" 2>/dev/null && sum=$((sum + t))
+	done
+	echo $sum
+}
+
+emu_start() {
+	local serial=$1
+
+	shift
+	"$emu" -p receiver -S "$serial" -d "$udc" "$@" > "$tmp/emu.log" 2>&1 &
+	emu_pid=$!
+}
+
+emu_stop() {
+	kill "$emu_pid" 2>/dev/null
+	wait "$emu_pid" 2>/dev/null
+	emu_pid=
+}
+
+# Wait up to 10 s for a power supply to appear (or, with -g, to go)
+wait_supply() {
+	local gone=0 i
+
+	[ "$1" = -g ] && { gone=1; shift; }
+	for ((i = 0; i < 1000; i++)); do
+		if [ -e "/sys/class/power_supply/$1" ]; then
+			[ $gone -eq 0 ] && return 0
+		else
+			[ $gone -eq 1 ] && return 0
+		fi
+		sleep 0.01
+	done
+	return 1
+}
+
+# The debugfs directory of a power supply's vendor interface
+supply_debugfs() {
+	echo "$debugfs/keychron/$(basename "$(readlink -f "/sys/class/power_supply/$1/device")")"
+}
+
+udevadm monitor --kernel --subsystem-match=power_supply > "$tmp/udev.log" &
+udev_pid=$!
+sleep 0.5
+
+# Probe latency
+for ((i = 1; i <= cycles; i++)); do
+	serial=BENCH$$X$i
+	supply=keychron_mouse_$serial
+
+	emu_start "$serial"
+	if ! wait_supply "$supply"; then
+		echo "cycle $i: no power supply, see the kernel log" >&2
+		exit 1
+	fi
+
+	added=
+	for ((j = 0; j < 200 && ${#added} == 0; j++)); do
+		added=$(sed -n "s|^KERNEL\[\([0-9.]*\)\] *add .*/power_supply/$supply (power_supply)|\1|p" \
+			"$tmp/udev.log")
+		[ -n "$added" ] || sleep 0.01
+	done
+	connect=$(awk '$2 == "connect" { print $1; exit }' "$tmp/emu.log")
+	configured=$(awk '$2 == "configured" { print $1; exit }' "$tmp/emu.log")
+	probe_us=$(stat_value "$(supply_debugfs "$supply")/queries" probe_us)
+
+	echo "$connect $configured $added $probe_us" >> "$tmp/probe"
+
+	emu_stop
+	wait_supply -g "$supply"
+	echo "cycle $i/$cycles" >&2
+done
+
+# Query cost
+serial=BENCH$$Q
+supply=keychron_mouse_$serial
+emu_start "$serial" -l "$latency" -L "$loss"
+wait_supply "$supply" || { echo "no power supply" >&2; exit 1; }
+dir=$(supply_debugfs "$supply")
+hid=$(basename "$dir")
+
+cp "$dir/queries" "$tmp/before"
+echo 'module keychron_battery +p' > $debugfs/dynamic_debug/control
+marker="keychron-bench: start $$"
+echo "$marker" > /dev/kmsg
+
+start=$(date +%s.%N)
+cpu_before=$(kworker_cpu_ns)
+for ((i = 0; i < queries; i++)); do
+	echo 1 > "$dir/poll"
+done
+cpu_after=$(kworker_cpu_ns)
+elapsed=$(awk -v s="$start" -v e="$(date +%s.%N)" 'BEGIN { print e - s }')
+
+cp "$dir/queries" "$tmp/after"
+echo 'module keychron_battery -p' > $debugfs/dynamic_debug/control
+dmesg | sed -n "/$marker/,\$p" | sed -n "s/.* $hid: query rtt \([0-9]*\) us.*/\1/p" \
+	> "$tmp/rtt"
+
+# What the kworkers burn anyway over the same time
+cpu_idle=$(kworker_cpu_ns)
+sleep "$elapsed"
+cpu_idle=$(($(kworker_cpu_ns) - cpu_idle))
+
+emu_stop
+
+delta() {
+	echo $(($(stat_value "$tmp/after" "$1") - $(stat_value "$tmp/before" "$1")))
+}
+n_queries=$(delta queries)
+n_failed=$(delta failed)
+n_attempts=$(delta attempts)
+n_timeouts=$(delta timeouts)
+cpu_ns=$((cpu_after - cpu_before - cpu_idle))
+
+awk -v probe="$tmp/probe" -v cycles="$cycles" -v latency="$latency" \
+    -v loss="$loss" -v polls="$queries" -v q="$n_queries" -v f="$n_failed" \
+    -v a="$n_attempts" -v t="$n_timeouts" -v cpu="$cpu_ns" \
+    -v rtt="$(percentiles < "$tmp/rtt")" \
+    -v connect="$(awk '{ print int(($3 - $1) * 1e6 + 0.5) }' "$tmp/probe" | percentiles)" \
+    -v configured="$(awk '{ print int(($3 - $2) * 1e6 + 0.5) }' "$tmp/probe" | percentiles)" \
+    -v probe_us="$(awk '{ print $4 }' "$tmp/probe" | percentiles)" '
+	BEGIN {
+		ok = q - f
+		printf "{\n"
+		printf "  \"probe\": {\n"
+		printf "    \"cycles\": %d,\n", cycles
+		printf "    \"connect_to_supply_us\": { %s },\n", connect
+		printf "    \"configured_to_supply_us\": { %s },\n", configured
+		printf "    \"driver_probe_us\": { %s }\n", probe_us
+		printf "  },\n"
+		printf "  \"queries\": {\n"
+		printf "    \"latency_ms\": \"%s\",\n", latency
+		printf "    \"loss_pct\": %s,\n", loss
+		printf "    \"polls\": %d,\n", polls
+		printf "    \"queries\": %d,\n", q
+		printf "    \"failed\": %d,\n", f
+		printf "    \"attempts\": %d,\n", a
+		printf "    \"timeouts\": %d,\n", t
+		printf "    \"attempts_per_success\": %.3f,\n", ok ? a / ok : 0
+		printf "    \"retries_per_success\": %.3f,\n", ok ? (a - q) / ok : 0
+		printf "    \"rtt_us\": { %s },\n", rtt
+		printf "    \"kworker_cpu_us_per_query\": %.1f\n", q ? cpu / q / 1000 : 0
+		printf "  }\n"
+		printf "}\n"
+	}'
@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * libFuzzer target for the Keychron mouse vendor protocol
+ *
+ * Copyright (c) 2026 Chris Sutcliff <chris@sutcliff.me>
+ *
+ * Feeds arbitrary bytes through the response matching, status parsing
+ * and query retry code of keychron_protocol.h, the same code the driver
+ * runs on whatever arrives on the vendor interface. The input is read as:
+ *
+ *   byte 0       number of transfers the query may make, 1-4
+ *   then chunks  one per transfer: a header byte, then the response
+ *
+ * A header with bit 7 set fails the transfer with the errno picked by its
+ * low two bits. Otherwise it is the response length the transport
+ * reports, 0-127, and that many bytes follow; whatever the input runs
+ * short of reads as zeroes. Running out of input times out.
+ *
+ * Build with clang and run on the seed corpus with "make fuzz". Without
+ * clang, -DFUZZ_STANDALONE adds a main() that replays input files, which
+ * "make fuzz-replay" runs over the corpus.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../keychron_protocol.h"
+
+#define FUZZ_MAX_RETRIES	4
+
+struct fuzz_transport {
+	const uint8_t *data;
+	size_t size;
+	int transfers;
+	int backoffs;
+	int last_backoff;
+};
+
+static const int fuzz_errors[] = { -ETIMEDOUT, -EPIPE, -ENODEV, -EPROTO };
+
+static int fuzz_transfer(void *ctx, u8 *resp, int size)
+{
+	struct fuzz_transport *ft = ctx;
+	size_t avail;
+	int len;
+
+	ft->transfers++;
+	if (!ft->size)
+		return -ETIMEDOUT;
+
+	len = ft->data[0];
+	ft->data++;
+	ft->size--;
+	if (len & 0x80)
+		return fuzz_errors[len & 3];
+
+	avail = (size_t)len < ft->size ? (size_t)len : ft->size;
+	memset(resp, 0, size);
+	memcpy(resp, ft->data, avail < (size_t)size ? avail : (size_t)size);
+	ft->data += avail;
+	ft->size -= avail;
+
+	/* May claim more than fits, as a confused transport could */
+	return len;
+}
+
+static void fuzz_backoff(void *ctx, int attempt)
+{
+	struct fuzz_transport *ft = ctx;
+
+	/* Retries are numbered 1, 2, ... in order */
+	if (attempt != ft->last_backoff + 1)
+		abort();
+	ft->backoffs++;
+	ft->last_backoff = attempt;
+}
+
+static const struct keychron_query_ops fuzz_ops = {
+	.transfer = fuzz_transfer,
+	.backoff = fuzz_backoff,
+};
+
+static void fuzz_parse(const uint8_t *data, size_t size)
+{
+	int len = size > 256 ? 256 : (int)size;
+	int ret;
+
+	if (keychron_response_action(data, len, -1) != KEYCHRON_RESP_STALE ||
+	    (keychron_response_action(data, len, KEYCHRON_CMD_STATUS) ==
+	     KEYCHRON_RESP_ACCEPT) !=
+	    keychron_response_matches(data, len, KEYCHRON_CMD_STATUS))
+		abort();
+
+	ret = keychron_parse_status(data, len);
+	if (ret >= 0 &&
+	    (len <= KEYCHRON_BATTERY_OFFSET ||
+	     ret != data[KEYCHRON_BATTERY_OFFSET] || ret > 100))
+		abort();
+	if (ret < 0 && ret != -EPROTO)
+		abort();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	struct fuzz_transport ft = { 0 };
+	int retries;
+	int attempts;
+	int ret;
+
+	fuzz_parse(data, size);
+
+	if (!size)
+		return 0;
+
+	retries = data[0] % FUZZ_MAX_RETRIES + 1;
+	ft.data = data + 1;
+	ft.size = size - 1;
+
+	ret = keychron_query_status(&fuzz_ops, &ft, retries, &attempts);
+
+	if (attempts < 1 || attempts > retries || attempts != ft.transfers ||
+	    ft.backoffs != attempts - 1)
+		abort();
+	/* A level ends the query at once, anything else uses every retry */
+	if (ret > 100 || (ret < 0 && ret != -ENODEV && attempts != retries))
+		abort();
+	if (ret < 0 && ret != -ETIMEDOUT && ret != -EPIPE &&
+	    ret != -ENODEV && ret != -EPROTO)
+		abort();
+
+	return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+#include <stdio.h>
+
+int main(int argc, char **argv)
+{
+	static uint8_t buf[1 << 16];
+	FILE *f;
+	size_t len;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		f = fopen(argv[i], "rb");
+		if (!f) {
+			perror(argv[i]);
+			return 1;
+		}
+		len = fread(buf, 1, sizeof(buf), f);
+		fclose(f);
+		LLVMFuzzerTestOneInput(buf, len);
+	}
+
+	printf("replayed: %d\n", argc - 1);
+	return 0;
+}
+#endif
@@ -0,0 +1,120 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Hotplug and teardown stress test for the keychron_battery driver
+#
+# Disconnects and reconnects a real Keychron receiver or mouse through its
+# USB "authorized" attribute, over and over, at random points of probe and
+# of the battery query, while other processes read the power supply and
+# debugfs files. It then reports teardown latency percentiles, taken from
+# the driver's "removed in N us" debug messages, and checks the kernel log
+# for KASAN, lockdep and other warnings and kmemleak for leaks.
+#
+# Run it on a kernel with CONFIG_KASAN, CONFIG_PROVE_LOCKING and
+# CONFIG_DEBUG_KMEMLEAK for the checks to mean anything.
+#
+# Usage: hotplug-stress.sh [-n cycles] [-m max_delay_ms] <usb device>
+#   e.g. hotplug-stress.sh -n 2000 3-2
+
+set -u
+
+cycles=1000
+max_delay_ms=1500
+
+usage() {
+	echo "Usage: $0 [-n cycles] [-m max_delay_ms] <usb device, e.g. 3-2>" >&2
+	exit 2
+}
+
+while getopts "n:m:" opt; do
+	case $opt in
+	n) cycles=$OPTARG ;;
+	m) max_delay_ms=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 1 ] || usage
+
+dev=/sys/bus/usb/devices/$1
+if [ "$(cat "$dev/idVendor" 2>/dev/null)" != "3434" ]; then
+	echo "$1 is not a Keychron USB device" >&2
+	exit 1
+fi
+if [ "$(id -u)" -ne 0 ]; then
+	echo "must run as root" >&2
+	exit 1
+fi
+
+debugfs=/sys/kernel/debug
+marker="keychron-stress: start $$"
+
+# The teardown time is logged through dynamic debug
+echo 'module keychron_battery +p' > $debugfs/dynamic_debug/control
+echo "$marker" > /dev/kmsg
+
+# Concurrent readers of everything the driver publishes
+readers=()
+for i in 1 2; do
+	(
+		while :; do
+			cat /sys/class/power_supply/keychron_mouse_*/{capacity,status,capacity_cached,sleep_timeout} \
+				$debugfs/keychron/*/{queries,intervals} \
+				/sys/bus/hid/drivers/keychron/*/coalesce_us
+		done >/dev/null 2>&1
+	) &
+	readers+=($!)
+done
+
+sleep_ms() {
+	sleep "$(printf '%d.%03d' $(($1 / 1000)) $(($1 % 1000)))"
+}
+
+for ((i = 0; i < cycles; i++)); do
+	echo 0 > "$dev/authorized"
+	sleep_ms $((RANDOM % 200))
+	echo 1 > "$dev/authorized"
+	# Land the next disconnect anywhere in probe, its query or a poll
+	sleep_ms $(((RANDOM * 32768 + RANDOM) % (max_delay_ms + 1)))
+done
+
+kill "${readers[@]}" 2>/dev/null
+wait 2>/dev/null
+
+log=$(dmesg | sed -n "/$marker/,\$p")
+
+echo "cycles: $cycles"
+
+# Teardown latency percentiles, nearest rank
+echo "$log" | sed -n 's/.*removed in \([0-9]*\) us.*/\1/p' | sort -n |
+awk '
+	{ v[NR] = $1 }
+	function pct(p,  r) { r = int((NR * p + 99) / 100); return v[r > 0 ? r : 1] }
+	END {
+		print "removals: " NR
+		if (NR) {
+			print "teardown_p50_us: " pct(50)
+			print "teardown_p99_us: " pct(99)
+			print "teardown_p999_us: " pct(99.9)
+			print "teardown_max_us: " v[NR]
+		}
+	}'
+
+status=0
+
+warnings=$(echo "$log" |
+	grep -cE 'BUG:|KASAN|WARNING:|possible circular locking|possible recursive locking|blocked for more than')
+echo "kernel_warnings: $warnings"
+[ "$warnings" -eq 0 ] || status=1
+
+if [ -e $debugfs/kmemleak ]; then
+	echo scan > $debugfs/kmemleak
+	# Backtrace lines of unreferenced objects allocated by the driver
+	leaks=$(grep -c keychron $debugfs/kmemleak)
+	echo "kmemleak_keychron_lines: $leaks"
+	[ "$leaks" -eq 0 ] || status=1
+else
+	echo "kmemleak_keychron_lines: unavailable"
+fi
+
+exit $status
@@ -0,0 +1,1077 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Keychron M5 / Ultra-Link 8K emulator on raw-gadget
+ *
+ * Copyright (c) 2026 Chris Sutcliff <chris@sutcliff.me>
+ *
+ * Presents 3434:d048 (the mouse on its cable) or 3434:d028 (the
+ * receiver) through a USB device controller driven by raw-gadget, so
+ * that keychron_battery can be probed, polled, unplugged and benchmarked
+ * without hardware. With dummy_hcd as the controller the device appears
+ * on a virtual bus of the same machine.
+ *
+ * The device has five HID interfaces with one interrupt-IN endpoint
+ * each. Interface 0 is the 8 kHz mouse and interface 4 the vendor
+ * interface carrying feature report 0xB3 and input report 0xB4. The
+ * keyboard, consumer and Launcher interfaces in between only keep the
+ * numbering; their descriptors are modelled, not copied from a device.
+ *
+ * Status requests (0xB3, command 0x06) are answered with a 0xB4 report
+ * from a battery curve, after a configurable latency, with configurable
+ * loss. The receiver stops answering once the mouse has been idle for
+ * the sleep time, until it moves again: with -m, or one nudge per
+ * SIGUSR1. Like the real device, a response the host doesn't collect
+ * stays queued on the endpoint and is delivered at its next poll.
+ *
+ * With -r the vendor interface plays back a script from keychron-replay
+ * instead: each request from the host takes the next "request" line,
+ * is checked against it, and is answered with the "response" lines that
+ * follow, each after its captured delay. Mismatches, requests past the
+ * end of the script and its end are logged as "replay" events.
+ *
+ * Needs root and a kernel with CONFIG_USB_RAW_GADGET, plus
+ * CONFIG_USB_DUMMY_HCD for the virtual bus:
+ *
+ *   modprobe dummy_hcd num=2 && modprobe raw_gadget
+ *   keychron-emu -p receiver -S EMU1 -l 8:4 -L 10 -b 80:-0.5
+ *
+ * Lifecycle events are printed on stdout as "<CLOCK_MONOTONIC seconds>
+ * <event>" lines, requests too with -v. Stopping the emulator unplugs
+ * the device.
+ */
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#include "../keychron_protocol.h"
+
+/* Events added to raw-gadget after 5.8 */
+#ifndef USB_RAW_EVENT_RESET
+#define USB_RAW_EVENT_SUSPEND		3
+#define USB_RAW_EVENT_RESUME		4
+#define USB_RAW_EVENT_RESET		5
+#define USB_RAW_EVENT_DISCONNECT	6
+#endif
+
+#define EMU_VENDOR_ID		0x3434
+#define EMU_PRODUCT_WIRED	0xd048
+#define EMU_PRODUCT_RECEIVER	0xd028
+
+#define EMU_INTERFACES		5
+#define EMU_MOUSE_INTF		0
+#define EMU_VENDOR_INTF		4
+
+#define EMU_EP0_MAX		1024
+
+#define HID_DT_HID		0x21
+#define HID_DT_REPORT		0x22
+#define HID_REQ_GET_REPORT	0x01
+#define HID_REQ_GET_IDLE	0x02
+#define HID_REQ_GET_PROTOCOL	0x03
+#define HID_REQ_SET_REPORT	0x09
+#define HID_REQ_SET_IDLE	0x0a
+#define HID_REQ_SET_PROTOCOL	0x0b
+
+struct hid_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint16_t bcdHID;
+	uint8_t bCountryCode;
+	uint8_t bNumDescriptors;
+	uint8_t bReportDescriptorType;
+	uint16_t wReportDescriptorLength;
+} __attribute__((packed));
+
+/* 5 buttons, 16-bit X/Y, wheel and AC pan; 7 bytes, no report ID */
+static const uint8_t mouse_report_desc[] = {
+	0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x09, 0x01, 0xa1, 0x00,
+	0x05, 0x09, 0x19, 0x01, 0x29, 0x05, 0x15, 0x00, 0x25, 0x01,
+	0x75, 0x01, 0x95, 0x05, 0x81, 0x02, 0x75, 0x03, 0x95, 0x01,
+	0x81, 0x01, 0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x16, 0x01,
+	0x80, 0x26, 0xff, 0x7f, 0x75, 0x10, 0x95, 0x02, 0x81, 0x06,
+	0x09, 0x38, 0x15, 0x81, 0x25, 0x7f, 0x75, 0x08, 0x95, 0x01,
+	0x81, 0x06, 0x05, 0x0c, 0x0a, 0x38, 0x02, 0x95, 0x01, 0x81,
+	0x06, 0xc0, 0xc0,
+};
+
+/* Boot keyboard */
+static const uint8_t keyboard_report_desc[] = {
+	0x05, 0x01, 0x09, 0x06, 0xa1, 0x01, 0x05, 0x07, 0x19, 0xe0,
+	0x29, 0xe7, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08,
+	0x81, 0x02, 0x95, 0x01, 0x75, 0x08, 0x81, 0x01, 0x95, 0x06,
+	0x75, 0x08, 0x15, 0x00, 0x26, 0xff, 0x00, 0x05, 0x07, 0x19,
+	0x00, 0x2a, 0xff, 0x00, 0x81, 0x00, 0xc0,
+};
+
+/* Consumer control, report ID 3 */
+static const uint8_t consumer_report_desc[] = {
+	0x05, 0x0c, 0x09, 0x01, 0xa1, 0x01, 0x85, 0x03, 0x15, 0x00,
+	0x26, 0xff, 0x03, 0x19, 0x00, 0x2a, 0xff, 0x03, 0x75, 0x10,
+	0x95, 0x01, 0x81, 0x00, 0xc0,
+};
+
+/* Launcher/firmware channel: 32-byte vendor reports */
+static const uint8_t launcher_report_desc[] = {
+	0x06, 0x60, 0xff, 0x09, 0x61, 0xa1, 0x01, 0x09, 0x62, 0x15,
+	0x00, 0x26, 0xff, 0x00, 0x95, 0x20, 0x75, 0x08, 0x81, 0x02,
+	0x09, 0x63, 0x15, 0x00, 0x26, 0xff, 0x00, 0x95, 0x20, 0x75,
+	0x08, 0x91, 0x02, 0xc0,
+};
+
+/* Feature report 0xB3 and input report 0xB4, 63 bytes after the ID */
+static const uint8_t vendor_report_desc[] = {
+	0x06, 0x00, 0xff, 0x09, 0x01, 0xa1, 0x01,
+	0x85, KEYCHRON_REPORT_ID_CMD, 0x09, 0x02, 0x15, 0x00, 0x26, 0xff,
+	0x00, 0x75, 0x08, 0x95, KEYCHRON_REPORT_SIZE - 1, 0xb1, 0x02,
+	0x85, KEYCHRON_REPORT_ID_RESP, 0x09, 0x03, 0x15, 0x00, 0x26, 0xff,
+	0x00, 0x75, 0x08, 0x95, KEYCHRON_REPORT_SIZE - 1, 0x81, 0x02,
+	0xc0,
+};
+
+struct emu_intf {
+	const uint8_t *report_desc;
+	uint16_t report_desc_len;
+	uint8_t subclass;
+	uint8_t protocol;
+	uint16_t maxpacket;
+	uint8_t interval;	/* high speed: 2^(n-1) microframes */
+	struct usb_endpoint_descriptor ep;
+	int handle;		/* raw-gadget endpoint, -1 until enabled */
+};
+
+#define EMU_INTF(desc, sub, proto, mps, ival) { \
+	.report_desc = (desc), .report_desc_len = sizeof(desc), \
+	.subclass = (sub), .protocol = (proto), .maxpacket = (mps), \
+	.interval = (ival), .handle = -1 }
+
+static struct emu_intf emu_intfs[EMU_INTERFACES] = {
+	EMU_INTF(mouse_report_desc, 1, 2, 16, 1),	/* 8 kHz */
+	EMU_INTF(keyboard_report_desc, 1, 1, 8, 4),
+	EMU_INTF(consumer_report_desc, 0, 0, 8, 4),
+	EMU_INTF(launcher_report_desc, 0, 0, 32, 4),
+	EMU_INTF(vendor_report_desc, 0, 0, KEYCHRON_REPORT_SIZE, 4),
+};
+
+/* A captured report and its delay after the request it followed */
+struct emu_replay_report {
+	double delay_ms;
+	uint8_t data[KEYCHRON_REPORT_SIZE];
+};
+
+/* A captured request and the reports that followed it */
+struct emu_replay_step {
+	uint8_t request[KEYCHRON_REPORT_SIZE];
+	int request_len;
+	struct emu_replay_report *reports;
+	int num_reports;
+};
+
+/* A 0xB4 report waiting for its delivery time */
+struct emu_response {
+	struct emu_response *next;
+	struct timespec due;
+	uint8_t data[KEYCHRON_REPORT_SIZE];
+};
+
+static struct {
+	uint16_t product;
+	const char *serial;
+	const char *udc_driver;
+	const char *udc_device;
+	double latency_ms;
+	double jitter_ms;
+	double loss_pct;
+	double sleep_s;
+	double battery;
+	double battery_rate;	/* percent per minute */
+	unsigned int motion_hz;
+	const char *replay;
+	bool verbose;
+} opt = {
+	.product = EMU_PRODUCT_RECEIVER,
+	.serial = "EMU0001",
+	.udc_driver = "dummy_udc",
+	.udc_device = "dummy_udc.0",
+	.battery = 80,
+};
+
+static int emu_fd;
+static struct timespec emu_start;
+static pthread_mutex_t emu_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t emu_cond;
+static bool emu_configured;		/* under emu_lock */
+static struct emu_response *emu_queue;	/* under emu_lock, by due time */
+static struct timespec emu_last_motion;	/* under emu_lock */
+static unsigned int emu_nudges;		/* under emu_lock */
+static struct emu_replay_step *emu_steps;
+static int emu_num_steps;
+static int emu_next_step;		/* ep0 thread only */
+
+static double ts_sec(const struct timespec *ts)
+{
+	return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+static struct timespec now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts;
+}
+
+static struct timespec ts_add_ms(struct timespec ts, double ms)
+{
+	long long ns = ts.tv_nsec + (long long)(ms * 1e6);
+
+	ts.tv_sec += ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	return ts;
+}
+
+static bool ts_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+	       (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void emu_log(const char *fmt, ...)
+{
+	struct timespec ts = now();
+	va_list ap;
+
+	flockfile(stdout);
+	printf("%lld.%06ld ", (long long)ts.tv_sec, ts.tv_nsec / 1000);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	putchar('\n');
+	funlockfile(stdout);
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static int emu_level(void)
+{
+	struct timespec ts = now();
+	double level = opt.battery +
+		       opt.battery_rate * (ts_sec(&ts) - ts_sec(&emu_start)) / 60;
+
+	if (level < 0)
+		return 0;
+	if (level > 100)
+		return 100;
+	return (int)(level + 0.5);
+}
+
+/* The mouse only sleeps on its battery, i.e. behind the receiver */
+static bool emu_asleep(void)
+{
+	struct timespec ts = now();
+	bool asleep;
+
+	if (opt.product != EMU_PRODUCT_RECEIVER || !opt.sleep_s)
+		return false;
+
+	pthread_mutex_lock(&emu_lock);
+	asleep = ts_sec(&ts) - ts_sec(&emu_last_motion) >= opt.sleep_s;
+	pthread_mutex_unlock(&emu_lock);
+	return asleep;
+}
+
+static void emu_queue_response(const uint8_t *data, double delay_ms)
+{
+	struct emu_response *resp, **pos;
+
+	resp = calloc(1, sizeof(*resp));
+	if (!resp)
+		die("calloc");
+	memcpy(resp->data, data, sizeof(resp->data));
+	resp->due = ts_add_ms(now(), delay_ms);
+
+	pthread_mutex_lock(&emu_lock);
+	for (pos = &emu_queue; *pos; pos = &(*pos)->next)
+		if (ts_before(&resp->due, &(*pos)->due))
+			break;
+	resp->next = *pos;
+	*pos = resp;
+	pthread_cond_broadcast(&emu_cond);
+	pthread_mutex_unlock(&emu_lock);
+}
+
+static int emu_parse_hex(const char *hex, uint8_t *data)
+{
+	int len = 0;
+
+	while (hex[0] && hex[1] && len < KEYCHRON_REPORT_SIZE &&
+	       sscanf(hex, "%2hhx", &data[len]) == 1) {
+		hex += 2;
+		len++;
+	}
+	return len;
+}
+
+/* Reads a keychron-replay script; its expect lines are for replay.sh */
+static void emu_load_replay(const char *path)
+{
+	struct emu_replay_step *step = NULL;
+	struct emu_replay_report *report;
+	char line[512], hex[256];
+	double delay;
+	int lineno = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		die(path);
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (sscanf(line, "request %255s", hex) == 1) {
+			emu_steps = realloc(emu_steps, (emu_num_steps + 1) *
+							sizeof(*emu_steps));
+			if (!emu_steps)
+				die("realloc");
+			step = &emu_steps[emu_num_steps++];
+			memset(step, 0, sizeof(*step));
+			step->request_len = emu_parse_hex(hex, step->request);
+		} else if (sscanf(line, "response %lf %255s", &delay,
+				  hex) == 2 && step) {
+			step->reports = realloc(step->reports,
+						(step->num_reports + 1) *
+						sizeof(*step->reports));
+			if (!step->reports)
+				die("realloc");
+			report = &step->reports[step->num_reports++];
+			memset(report, 0, sizeof(*report));
+			report->delay_ms = delay;
+			emu_parse_hex(hex, report->data);
+		} else if (line[0] != '#' && line[0] != '\n' &&
+			   strncmp(line, "expect ", 7)) {
+			fprintf(stderr, "%s:%d: bad line\n", path, lineno);
+			exit(1);
+		}
+	}
+	fclose(f);
+
+	if (!emu_num_steps) {
+		fprintf(stderr, "%s: no requests\n", path);
+		exit(1);
+	}
+}
+
+/* Answers a request with the next step of the script */
+static void emu_replay(const uint8_t *data, int len)
+{
+	struct emu_replay_step *step;
+	int n = emu_next_step + 1;
+	int i;
+
+	if (emu_next_step == emu_num_steps) {
+		emu_log("replay extra request cmd=0x%02x", data[1]);
+		return;
+	}
+	step = &emu_steps[emu_next_step++];
+
+	if (step->request_len > len ||
+	    memcmp(step->request, data, step->request_len))
+		emu_log("replay step %d mismatch cmd=0x%02x", n, data[1]);
+	else if (opt.verbose)
+		emu_log("replay step %d reports=%d", n, step->num_reports);
+
+	for (i = 0; i < step->num_reports; i++)
+		emu_queue_response(step->reports[i].data,
+				   step->reports[i].delay_ms);
+
+	if (emu_next_step == emu_num_steps)
+		emu_log("replay done steps=%d", emu_num_steps);
+}
+
+/* A feature report written to the vendor interface */
+static void emu_set_report(const uint8_t *data, int len)
+{
+	uint8_t resp[KEYCHRON_REPORT_SIZE];
+	double delay;
+	int level;
+
+	if (len < 2 || data[0] != KEYCHRON_REPORT_ID_CMD)
+		return;
+
+	if (emu_steps) {
+		emu_replay(data, len);
+		return;
+	}
+
+	if (data[1] != KEYCHRON_CMD_STATUS) {
+		if (opt.verbose)
+			emu_log("request cmd=0x%02x unhandled", data[1]);
+		return;
+	}
+
+	if (emu_asleep()) {
+		if (opt.verbose)
+			emu_log("request asleep");
+		return;
+	}
+	if (opt.loss_pct && drand48() * 100 < opt.loss_pct) {
+		if (opt.verbose)
+			emu_log("request lost");
+		return;
+	}
+
+	level = emu_level();
+	memset(resp, 0, sizeof(resp));
+	resp[0] = KEYCHRON_REPORT_ID_RESP;
+	resp[1] = KEYCHRON_CMD_STATUS;
+	resp[KEYCHRON_BATTERY_OFFSET] = level;
+
+	delay = opt.latency_ms + drand48() * opt.jitter_ms;
+	if (opt.verbose)
+		emu_log("request level=%d delay_ms=%.3f", level, delay);
+	emu_queue_response(resp, delay);
+}
+
+static int emu_ep_write(struct emu_intf *intf, const uint8_t *data, int len)
+{
+	struct {
+		struct usb_raw_ep_io io;
+		uint8_t data[KEYCHRON_REPORT_SIZE];
+	} w;
+
+	w.io.ep = intf->handle;
+	w.io.flags = 0;
+	w.io.length = len;
+	memcpy(w.data, data, len);
+	return ioctl(emu_fd, USB_RAW_IOCTL_EP_WRITE, &w);
+}
+
+static void emu_wait_configured(void)
+{
+	pthread_mutex_lock(&emu_lock);
+	while (!emu_configured)
+		pthread_cond_wait(&emu_cond, &emu_lock);
+	pthread_mutex_unlock(&emu_lock);
+}
+
+/*
+ * Delivers queued responses on the vendor interface. The write blocks
+ * until the host polls the endpoint, so a response the driver gave up
+ * on reaches whoever polls next, as on the real device.
+ */
+static void *emu_vendor_thread(void *arg)
+{
+	struct emu_intf *intf = &emu_intfs[EMU_VENDOR_INTF];
+	struct emu_response *resp;
+	struct timespec ts;
+
+	for (;;) {
+		emu_wait_configured();
+
+		pthread_mutex_lock(&emu_lock);
+		for (;;) {
+			ts = now();
+			resp = emu_queue;
+			if (resp && !ts_before(&ts, &resp->due))
+				break;
+			if (resp)
+				pthread_cond_timedwait(&emu_cond, &emu_lock,
+						       &resp->due);
+			else
+				pthread_cond_wait(&emu_cond, &emu_lock);
+		}
+		emu_queue = resp->next;
+		pthread_mutex_unlock(&emu_lock);
+
+		if (emu_ep_write(intf, resp->data, sizeof(resp->data)) < 0) {
+			/* Reset or unplugged: the response is lost */
+			if (opt.verbose)
+				emu_log("response lost: %s", strerror(errno));
+			usleep(10000);
+		} else if (opt.verbose) {
+			emu_log("response level=%d",
+				resp->data[KEYCHRON_BATTERY_OFFSET]);
+		}
+		free(resp);
+	}
+	return NULL;
+}
+
+static bool emu_take_nudge(void)
+{
+	bool nudge;
+
+	pthread_mutex_lock(&emu_lock);
+	nudge = emu_nudges;
+	if (nudge)
+		emu_nudges--;
+	pthread_mutex_unlock(&emu_lock);
+	return nudge;
+}
+
+static void emu_motion(int16_t dx)
+{
+	uint8_t report[7] = { 0, dx & 0xff, (dx >> 8) & 0xff };
+
+	if (emu_ep_write(&emu_intfs[EMU_MOUSE_INTF], report,
+			 sizeof(report)) < 0) {
+		usleep(10000);
+		return;
+	}
+
+	pthread_mutex_lock(&emu_lock);
+	emu_last_motion = now();
+	pthread_mutex_unlock(&emu_lock);
+}
+
+/*
+ * Moves the mouse back and forth at -m reports per second, or once per
+ * SIGUSR1. The write blocks until the host polls, which paces it at the
+ * endpoint's 8 kHz at most.
+ */
+static void *emu_mouse_thread(void *arg)
+{
+	struct timespec next;
+	unsigned long n = 0;
+
+	emu_wait_configured();
+	next = now();
+
+	for (;;) {
+		if (opt.motion_hz) {
+			next = ts_add_ms(next, 1000.0 / opt.motion_hz);
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+					NULL);
+			emu_motion(n++ & 1 ? -1 : 1);
+		} else if (emu_take_nudge()) {
+			emu_motion(1);
+			emu_motion(-1);
+			if (opt.verbose)
+				emu_log("nudge");
+		} else {
+			usleep(10000);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * SIGUSR1 is blocked everywhere else and taken here, so that it never
+ * interrupts a raw-gadget ioctl.
+ */
+static void *emu_signal_thread(void *arg)
+{
+	sigset_t *set = arg;
+	int sig;
+
+	for (;;) {
+		if (sigwait(set, &sig))
+			continue;
+		pthread_mutex_lock(&emu_lock);
+		emu_nudges++;
+		pthread_mutex_unlock(&emu_lock);
+	}
+	return NULL;
+}
+
+static bool emu_ep_int_in(const struct usb_raw_ep_info *ep)
+{
+	return ep->caps.type_int && ep->caps.dir_in;
+}
+
+/*
+ * Give every interface an interrupt-IN endpoint the controller has.
+ * Endpoints with a fixed address are taken first, then the lowest
+ * numbers those leave free go to endpoints that take any address.
+ */
+static void emu_assign_endpoints(void)
+{
+	struct usb_raw_eps_info info;
+	uint8_t addrs[EMU_INTERFACES];
+	bool used[16] = { true };
+	unsigned int addr;
+	int count;
+	int n = 0;
+	int i;
+
+	memset(&info, 0, sizeof(info));
+	count = ioctl(emu_fd, USB_RAW_IOCTL_EPS_INFO, &info);
+	if (count < 0)
+		die("USB_RAW_IOCTL_EPS_INFO");
+
+	for (i = 0; i < count && n < EMU_INTERFACES; i++) {
+		addr = info.eps[i].addr;
+		if (!emu_ep_int_in(&info.eps[i]) ||
+		    addr == USB_RAW_EP_ADDR_ANY || addr >= 16 || used[addr])
+			continue;
+		used[addr] = true;
+		addrs[n++] = addr;
+	}
+
+	for (i = 0; i < count && n < EMU_INTERFACES; i++) {
+		if (!emu_ep_int_in(&info.eps[i]) ||
+		    info.eps[i].addr != USB_RAW_EP_ADDR_ANY)
+			continue;
+		for (addr = 1; addr < 16 && used[addr]; addr++)
+			;
+		if (addr == 16)
+			break;
+		used[addr] = true;
+		addrs[n++] = addr;
+	}
+
+	if (n < EMU_INTERFACES) {
+		fprintf(stderr, "%s has too few interrupt-IN endpoints\n",
+			opt.udc_device);
+		exit(1);
+	}
+
+	for (i = 0; i < EMU_INTERFACES; i++)
+		emu_intfs[i].ep = (struct usb_endpoint_descriptor) {
+			.bLength = USB_DT_ENDPOINT_SIZE,
+			.bDescriptorType = USB_DT_ENDPOINT,
+			.bEndpointAddress = USB_DIR_IN | addrs[i],
+			.bmAttributes = USB_ENDPOINT_XFER_INT,
+			.wMaxPacketSize = htole16(emu_intfs[i].maxpacket),
+			.bInterval = emu_intfs[i].interval,
+		};
+}
+
+static int emu_string(int index, uint8_t *buf)
+{
+	const char *s;
+	int i;
+
+	switch (index) {
+	case 0:
+		buf[0] = 4;
+		buf[1] = USB_DT_STRING;
+		buf[2] = 0x09;	/* en-US */
+		buf[3] = 0x04;
+		return 4;
+	case 1:
+		s = "Keychron";
+		break;
+	case 2:
+		s = opt.product == EMU_PRODUCT_WIRED ?
+		    "Keychron M5" : "Keychron Ultra-Link 8K";
+		break;
+	case 3:
+		s = opt.serial;
+		break;
+	default:
+		return -1;
+	}
+
+	for (i = 0; s[i] && i < 126; i++) {
+		buf[2 + 2 * i] = s[i];
+		buf[3 + 2 * i] = 0;
+	}
+	buf[0] = 2 + 2 * i;
+	buf[1] = USB_DT_STRING;
+	return buf[0];
+}
+
+static void emu_hid_desc(int i, struct hid_descriptor *hid)
+{
+	*hid = (struct hid_descriptor) {
+		.bLength = sizeof(*hid),
+		.bDescriptorType = HID_DT_HID,
+		.bcdHID = htole16(0x0111),
+		.bNumDescriptors = 1,
+		.bReportDescriptorType = HID_DT_REPORT,
+		.wReportDescriptorLength =
+			htole16(emu_intfs[i].report_desc_len),
+	};
+}
+
+static int emu_config_desc(uint8_t *buf)
+{
+	struct usb_config_descriptor *config = (void *)buf;
+	struct usb_interface_descriptor *intf;
+	int len = USB_DT_CONFIG_SIZE;
+	int i;
+
+	for (i = 0; i < EMU_INTERFACES; i++) {
+		intf = (void *)(buf + len);
+		*intf = (struct usb_interface_descriptor) {
+			.bLength = USB_DT_INTERFACE_SIZE,
+			.bDescriptorType = USB_DT_INTERFACE,
+			.bInterfaceNumber = i,
+			.bNumEndpoints = 1,
+			.bInterfaceClass = USB_CLASS_HID,
+			.bInterfaceSubClass = emu_intfs[i].subclass,
+			.bInterfaceProtocol = emu_intfs[i].protocol,
+		};
+		len += USB_DT_INTERFACE_SIZE;
+
+		emu_hid_desc(i, (struct hid_descriptor *)(buf + len));
+		len += sizeof(struct hid_descriptor);
+
+		memcpy(buf + len, &emu_intfs[i].ep, USB_DT_ENDPOINT_SIZE);
+		len += USB_DT_ENDPOINT_SIZE;
+	}
+
+	*config = (struct usb_config_descriptor) {
+		.bLength = USB_DT_CONFIG_SIZE,
+		.bDescriptorType = USB_DT_CONFIG,
+		.wTotalLength = htole16(len),
+		.bNumInterfaces = EMU_INTERFACES,
+		.bConfigurationValue = 1,
+		.bmAttributes = USB_CONFIG_ATT_ONE | USB_CONFIG_ATT_WAKEUP,
+		.bMaxPower = 250,	/* 500 mA */
+	};
+	return len;
+}
+
+/* Answer a standard or class IN request; -1 stalls */
+static int emu_control_in(const struct usb_ctrlrequest *ctrl, uint8_t *buf)
+{
+	uint16_t value = le16toh(ctrl->wValue);
+	uint16_t index = le16toh(ctrl->wIndex);
+	uint16_t length = le16toh(ctrl->wLength);
+	struct usb_device_descriptor *dev = (void *)buf;
+	struct usb_qualifier_descriptor *qual = (void *)buf;
+
+	if ((ctrl->bRequestType & USB_TYPE_MASK) == USB_TYPE_CLASS) {
+		switch (ctrl->bRequest) {
+		case HID_REQ_GET_REPORT:
+			if (length > EMU_EP0_MAX)
+				return -1;
+			memset(buf, 0, length);
+			buf[0] = value & 0xff;
+			return length;
+		case HID_REQ_GET_IDLE:
+			buf[0] = 0;
+			return 1;
+		case HID_REQ_GET_PROTOCOL:
+			buf[0] = 1;
+			return 1;
+		}
+		return -1;
+	}
+
+	switch (ctrl->bRequest) {
+	case USB_REQ_GET_STATUS:
+		buf[0] = 0;
+		buf[1] = 0;
+		return 2;
+	case USB_REQ_GET_CONFIGURATION:
+		pthread_mutex_lock(&emu_lock);
+		buf[0] = emu_configured;
+		pthread_mutex_unlock(&emu_lock);
+		return 1;
+	case USB_REQ_GET_INTERFACE:
+		buf[0] = 0;
+		return 1;
+	case USB_REQ_GET_DESCRIPTOR:
+		break;
+	default:
+		return -1;
+	}
+
+	if ((ctrl->bRequestType & USB_RECIP_MASK) == USB_RECIP_INTERFACE) {
+		if (index >= EMU_INTERFACES)
+			return -1;
+		switch (value >> 8) {
+		case HID_DT_REPORT:
+			memcpy(buf, emu_intfs[index].report_desc,
+			       emu_intfs[index].report_desc_len);
+			return emu_intfs[index].report_desc_len;
+		case HID_DT_HID:
+			emu_hid_desc(index, (struct hid_descriptor *)buf);
+			return sizeof(struct hid_descriptor);
+		}
+		return -1;
+	}
+
+	switch (value >> 8) {
+	case USB_DT_DEVICE:
+		*dev = (struct usb_device_descriptor) {
+			.bLength = USB_DT_DEVICE_SIZE,
+			.bDescriptorType = USB_DT_DEVICE,
+			.bcdUSB = htole16(0x0200),
+			.bMaxPacketSize0 = 64,
+			.idVendor = htole16(EMU_VENDOR_ID),
+			.idProduct = htole16(opt.product),
+			.bcdDevice = htole16(0x0100),
+			.iManufacturer = 1,
+			.iProduct = 2,
+			.iSerialNumber = 3,
+			.bNumConfigurations = 1,
+		};
+		return USB_DT_DEVICE_SIZE;
+	case USB_DT_DEVICE_QUALIFIER:
+		*qual = (struct usb_qualifier_descriptor) {
+			.bLength = sizeof(*qual),
+			.bDescriptorType = USB_DT_DEVICE_QUALIFIER,
+			.bcdUSB = htole16(0x0200),
+			.bMaxPacketSize0 = 64,
+			.bNumConfigurations = 1,
+		};
+		return sizeof(*qual);
+	case USB_DT_CONFIG:
+		return emu_config_desc(buf);
+	case USB_DT_STRING:
+		return emu_string(value & 0xff, buf);
+	}
+	return -1;
+}
+
+static void emu_set_configuration(int value)
+{
+	int i;
+
+	pthread_mutex_lock(&emu_lock);
+	if (value && emu_intfs[0].handle < 0) {
+		for (i = 0; i < EMU_INTERFACES; i++) {
+			emu_intfs[i].handle = ioctl(emu_fd,
+						    USB_RAW_IOCTL_EP_ENABLE,
+						    &emu_intfs[i].ep);
+			if (emu_intfs[i].handle < 0)
+				die("USB_RAW_IOCTL_EP_ENABLE");
+		}
+		if (ioctl(emu_fd, USB_RAW_IOCTL_VBUS_DRAW, 500) < 0)
+			die("USB_RAW_IOCTL_VBUS_DRAW");
+		if (ioctl(emu_fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0)
+			die("USB_RAW_IOCTL_CONFIGURE");
+	}
+	emu_configured = value;
+	if (value)
+		emu_last_motion = now();
+	pthread_cond_broadcast(&emu_cond);
+	pthread_mutex_unlock(&emu_lock);
+
+	emu_log(value ? "configured" : "unconfigured");
+}
+
+/* Whether an OUT request is one we accept */
+static bool emu_control_out_ok(const struct usb_ctrlrequest *ctrl)
+{
+	if ((ctrl->bRequestType & USB_TYPE_MASK) == USB_TYPE_CLASS)
+		return ctrl->bRequest == HID_REQ_SET_REPORT ||
+		       ctrl->bRequest == HID_REQ_SET_IDLE ||
+		       ctrl->bRequest == HID_REQ_SET_PROTOCOL;
+
+	return ctrl->bRequest == USB_REQ_SET_CONFIGURATION ||
+	       ctrl->bRequest == USB_REQ_SET_INTERFACE ||
+	       ctrl->bRequest == USB_REQ_SET_FEATURE ||
+	       ctrl->bRequest == USB_REQ_CLEAR_FEATURE;
+}
+
+static void emu_control(const struct usb_ctrlrequest *ctrl)
+{
+	struct {
+		struct usb_raw_ep_io io;
+		uint8_t data[EMU_EP0_MAX];
+	} io;
+	uint16_t length = le16toh(ctrl->wLength);
+	int len;
+
+	io.io.ep = 0;
+	io.io.flags = 0;
+
+	if (ctrl->bRequestType & USB_DIR_IN) {
+		len = emu_control_in(ctrl, io.data);
+		if (len < 0)
+			goto stall;
+		io.io.length = len < length ? len : length;
+		if (ioctl(emu_fd, USB_RAW_IOCTL_EP0_WRITE, &io) < 0)
+			emu_log("ep0 write: %s", strerror(errno));
+		return;
+	}
+
+	if (!emu_control_out_ok(ctrl) || length > EMU_EP0_MAX)
+		goto stall;
+
+	/* Endpoints go live before the status stage acks the request */
+	if ((ctrl->bRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD &&
+	    ctrl->bRequest == USB_REQ_SET_CONFIGURATION)
+		emu_set_configuration(le16toh(ctrl->wValue) & 0xff);
+
+	/* Reading the data stage, if any, also acks the request */
+	io.io.length = length;
+	len = ioctl(emu_fd, USB_RAW_IOCTL_EP0_READ, &io);
+	if (len < 0) {
+		emu_log("ep0 read: %s", strerror(errno));
+		return;
+	}
+
+	if ((ctrl->bRequestType & USB_TYPE_MASK) == USB_TYPE_CLASS &&
+	    ctrl->bRequest == HID_REQ_SET_REPORT &&
+	    le16toh(ctrl->wIndex) == EMU_VENDOR_INTF)
+		emu_set_report(io.data, len);
+	return;
+
+stall:
+	if (ioctl(emu_fd, USB_RAW_IOCTL_EP0_STALL, 0) < 0)
+		emu_log("ep0 stall: %s", strerror(errno));
+}
+
+static void emu_ep0_loop(void)
+{
+	struct {
+		struct usb_raw_event event;
+		uint8_t data[sizeof(struct usb_ctrlrequest)];
+	} ev;
+
+	for (;;) {
+		ev.event.type = 0;
+		ev.event.length = sizeof(ev.data);
+		if (ioctl(emu_fd, USB_RAW_IOCTL_EVENT_FETCH, &ev) < 0)
+			die("USB_RAW_IOCTL_EVENT_FETCH");
+
+		switch (ev.event.type) {
+		case USB_RAW_EVENT_CONNECT:
+			emu_assign_endpoints();
+			emu_log("connect");
+			break;
+		case USB_RAW_EVENT_CONTROL:
+			emu_control((struct usb_ctrlrequest *)ev.data);
+			break;
+		case USB_RAW_EVENT_RESET:
+			emu_log("reset");
+			break;
+		case USB_RAW_EVENT_DISCONNECT:
+			pthread_mutex_lock(&emu_lock);
+			emu_configured = false;
+			pthread_mutex_unlock(&emu_lock);
+			emu_log("disconnect");
+			break;
+		}
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-p wired|receiver] [-S serial] [-d udc_device] [-D udc_driver]\n"
+		"          [-l latency_ms[:jitter_ms]] [-L loss_pct] [-s sleep_s]\n"
+		"          [-b level[:pct_per_min]] [-m motion_hz] [-r script] [-v]\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct usb_raw_init init;
+	pthread_condattr_t attr;
+	pthread_t thread;
+	sigset_t sigs;
+	char *end;
+	int c;
+
+	while ((c = getopt(argc, argv, "p:S:d:D:l:L:s:b:m:r:v")) != -1) {
+		switch (c) {
+		case 'p':
+			if (!strcmp(optarg, "wired"))
+				opt.product = EMU_PRODUCT_WIRED;
+			else if (!strcmp(optarg, "receiver"))
+				opt.product = EMU_PRODUCT_RECEIVER;
+			else
+				usage(argv[0]);
+			break;
+		case 'S':
+			opt.serial = optarg;
+			break;
+		case 'd':
+			opt.udc_device = optarg;
+			break;
+		case 'D':
+			opt.udc_driver = optarg;
+			break;
+		case 'l':
+			opt.latency_ms = strtod(optarg, &end);
+			if (*end == ':')
+				opt.jitter_ms = strtod(end + 1, &end);
+			if (*end)
+				usage(argv[0]);
+			break;
+		case 'L':
+			opt.loss_pct = strtod(optarg, NULL);
+			break;
+		case 's':
+			opt.sleep_s = strtod(optarg, NULL);
+			break;
+		case 'b':
+			opt.battery = strtod(optarg, &end);
+			if (*end == ':')
+				opt.battery_rate = strtod(end + 1, &end);
+			if (*end)
+				usage(argv[0]);
+			break;
+		case 'm':
+			opt.motion_hz = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			opt.replay = optarg;
+			break;
+		case 'v':
+			opt.verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
+
+	if (opt.replay)
+		emu_load_replay(opt.replay);
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	srand48(getpid());
+	emu_start = now();
+	emu_last_motion = emu_start;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&emu_cond, &attr);
+
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	emu_fd = open("/dev/raw-gadget", O_RDWR);
+	if (emu_fd < 0)
+		die("/dev/raw-gadget");
+
+	memset(&init, 0, sizeof(init));
+	snprintf((char *)init.driver_name, sizeof(init.driver_name), "%s",
+		 opt.udc_driver);
+	snprintf((char *)init.device_name, sizeof(init.device_name), "%s",
+		 opt.udc_device);
+	init.speed = USB_SPEED_HIGH;
+	if (ioctl(emu_fd, USB_RAW_IOCTL_INIT, &init) < 0)
+		die("USB_RAW_IOCTL_INIT");
+	if (ioctl(emu_fd, USB_RAW_IOCTL_RUN, 0) < 0)
+		die("USB_RAW_IOCTL_RUN");
+
+	if (pthread_create(&thread, NULL, emu_signal_thread, &sigs) ||
+	    pthread_create(&thread, NULL, emu_vendor_thread, NULL) ||
+	    pthread_create(&thread, NULL, emu_mouse_thread, NULL))
+		die("pthread_create");
+
+	emu_log("started %04x:%04x serial=%s", EMU_VENDOR_ID, opt.product,
+		opt.serial);
+	emu_ep0_loop();
+	return 0;
+}
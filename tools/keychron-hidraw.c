@@ -0,0 +1,182 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Userspace reference client for the Keychron mouse vendor protocol
+ *
+ * Copyright (c) 2026 Chris Sutcliff <chris@sutcliff.me>
+ *
+ * Sends the same status request as the driver (feature report 0xB3,
+ * command 0x06) through the hidraw node of the vendor interface, waits
+ * for the 0xB4 response and reports the battery level and the round-trip
+ * time. Repeated queries give a latency distribution of the device and
+ * radio alone, to compare against the driver's own query statistics.
+ *
+ * Usage: keychron-hidraw [-n count] [-i interval_ms] [-v] /dev/hidrawN
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+
+#include "../keychron_protocol.h"
+
+#define RESPONSE_TIMEOUT_MS	500	/* as KEYCHRON_RESPONSE_TIMEOUT_MS */
+
+static long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* One status query; returns the battery level or a negative errno */
+static int query(int fd, long long *rtt_us)
+{
+	unsigned char buf[KEYCHRON_REPORT_SIZE];
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	long long start, deadline;
+	ssize_t len;
+	int ret;
+
+	memset(buf, 0, sizeof(buf));
+	buf[0] = KEYCHRON_REPORT_ID_CMD;
+	buf[1] = KEYCHRON_CMD_STATUS;
+
+	start = now_us();
+	deadline = start + RESPONSE_TIMEOUT_MS * 1000LL;
+
+	if (ioctl(fd, HIDIOCSFEATURE(sizeof(buf)), buf) < 0)
+		return -errno;
+
+	/* Skip unrelated input reports until the response or the timeout */
+	for (;;) {
+		ret = poll(&pfd, 1, (deadline - now_us() + 999) / 1000);
+		if (ret < 0)
+			return -errno;
+		if (!ret || now_us() >= deadline)
+			return -ETIMEDOUT;
+
+		len = read(fd, buf, sizeof(buf));
+		if (len < 0)
+			return -errno;
+		if (keychron_response_matches(buf, len, KEYCHRON_CMD_STATUS))
+			break;
+	}
+
+	*rtt_us = now_us() - start;
+	return keychron_parse_status(buf, len);
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a;
+	long long y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of a sorted array */
+static long long percentile(const long long *v, int n, int pct)
+{
+	int rank = (n * pct + 99) / 100;
+
+	return v[rank > 0 ? rank - 1 : 0];
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-n count] [-i interval_ms] [-v] /dev/hidrawN\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	long long *rtt;
+	long long sample = 0;
+	int count = 1;
+	int interval_ms = 0;
+	int verbose = 0;
+	int ok = 0;
+	int failed = 0;
+	int battery = -1;
+	int opt;
+	int fd;
+	int ret;
+	int i;
+
+	while ((opt = getopt(argc, argv, "n:i:v")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'i':
+			interval_ms = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || count < 1 || interval_ms < 0)
+		usage(argv[0]);
+
+	fd = open(argv[optind], O_RDWR);
+	if (fd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	rtt = calloc(count, sizeof(*rtt));
+	if (!rtt) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (i && interval_ms)
+			usleep(interval_ms * 1000);
+
+		ret = query(fd, &sample);
+		if (ret < 0) {
+			failed++;
+			if (verbose)
+				fprintf(stderr, "query %d: %s\n", i,
+					strerror(-ret));
+			continue;
+		}
+
+		battery = ret;
+		rtt[ok++] = sample;
+		if (verbose)
+			printf("query %d: %d%% %lld us\n", i, ret, sample);
+	}
+
+	close(fd);
+
+	/* Same "key: value" layout as the driver's debugfs statistics */
+	printf("queries: %d\n", count);
+	printf("failed: %d\n", failed);
+	if (ok) {
+		qsort(rtt, ok, sizeof(*rtt), cmp_ll);
+		printf("battery: %d\n", battery);
+		printf("rtt_min_us: %lld\n", rtt[0]);
+		printf("rtt_p50_us: %lld\n", percentile(rtt, ok, 50));
+		printf("rtt_p90_us: %lld\n", percentile(rtt, ok, 90));
+		printf("rtt_p99_us: %lld\n", percentile(rtt, ok, 99));
+		printf("rtt_max_us: %lld\n", rtt[ok - 1]);
+	}
+
+	free(rtt);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,330 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Turns a usbmon capture of Keychron mouse traffic into a replay script
+ *
+ * Copyright (c) 2026 Chris Sutcliff <chris@sutcliff.me>
+ *
+ * Reads the usbmon text of /sys/kernel/debug/usb/usbmon/<bus>u, or a
+ * pcap file of a usbmon capture (Wireshark, tcpdump -i usbmonN), and
+ * writes the vendor protocol exchanges in it as a script for
+ * keychron-emu -r, which then plays the device side back to the driver:
+ *
+ *   request <hex>         the next request the driver must send
+ *   response <ms> <hex>   a report the device sent <ms> after that request
+ *   expect <level>        a battery level the captured responses carried
+ *
+ * Requests are SET_REPORT 0xB3 feature reports on the control endpoint,
+ * responses the 0xB4 input reports on an interrupt endpoint. Responses
+ * keep their delay after the request they followed, including those that
+ * came too late for it. Only one device is read: -a picks it by bus and
+ * address, otherwise it is the device of the first request.
+ *
+ * usbmon text keeps only the first 32 bytes of a transfer, which still
+ * holds the status response's battery level; the emulator zero-fills the
+ * rest and checks requests over the captured bytes only. pcapng files
+ * must be converted first, e.g. with editcap -F pcap.
+ *
+ * Usage: keychron-replay [-a bus:address] [capture]
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../keychron_protocol.h"
+
+#define PCAP_MAGIC		0xa1b2c3d4
+#define PCAP_MAGIC_NS		0xa1b23c4d
+#define PCAPNG_MAGIC		0x0a0d0d0a
+#define LINKTYPE_USB_LINUX	189
+#define LINKTYPE_USB_LINUX_MMAPPED	220
+
+#define USB_XFER_INTERRUPT	1
+#define USB_XFER_CONTROL	2
+#define HID_REQ_SET_REPORT	0x09
+
+static int filter_bus = -1;
+static int filter_addr = -1;
+static double last_request = -1;	/* capture time, seconds */
+static int num_requests;
+static int num_responses;
+static int num_expected;
+static int num_skipped;
+
+static void print_hex(const uint8_t *data, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		printf("%02x", data[i]);
+	putchar('\n');
+}
+
+/* One transfer of the capture: a request or an input report */
+static void replay_event(double t, int bus, int addr, bool request,
+			 const uint8_t *data, int len)
+{
+	int level;
+
+	if (len > KEYCHRON_REPORT_SIZE)
+		len = KEYCHRON_REPORT_SIZE;
+
+	if (filter_addr < 0 && request) {
+		filter_bus = bus;
+		filter_addr = addr;
+		printf("# bus %d address %d\n", bus, addr);
+	}
+	if (bus != filter_bus || addr != filter_addr) {
+		num_skipped++;
+		return;
+	}
+
+	if (request) {
+		printf("request ");
+		print_hex(data, len);
+		last_request = t;
+		num_requests++;
+		return;
+	}
+
+	/* Reports from before the first request belong to nothing */
+	if (last_request < 0) {
+		num_skipped++;
+		return;
+	}
+
+	printf("response %.3f ", (t - last_request) * 1000);
+	print_hex(data, len);
+	num_responses++;
+
+	if (!keychron_response_matches(data, len, KEYCHRON_CMD_STATUS))
+		return;
+	level = keychron_parse_status(data, len);
+	if (level >= 0) {
+		printf("expect %d\n", level);
+		num_expected++;
+	}
+}
+
+/*
+ * usbmon text, 0u or 1u format:
+ *   <tag> <usec> S Co:1:003:0 s 21 09 03b3 0004 0040 64 = b3060000 ...
+ *   <tag> <usec> C Ii:1:003:4 0:1 64 = b4060000 ...
+ */
+static int read_text(FILE *f)
+{
+	static const char *sep = " \t\n";
+	char line[1024];
+	uint8_t data[KEYCHRON_REPORT_SIZE];
+	unsigned long usec, prev_usec = 0;
+	double wraps = 0;
+	char *tok[32];
+	char *p, *save;
+	int bus, addr, ep;
+	bool request;
+	int n, i, len;
+
+	while (fgets(line, sizeof(line), f)) {
+		n = 0;
+		for (p = strtok_r(line, sep, &save); p && n < 32;
+		     p = strtok_r(NULL, sep, &save))
+			tok[n++] = p;
+		if (n < 5)
+			continue;
+
+		/* A 32-bit microsecond counter */
+		usec = strtoul(tok[1], NULL, 10);
+		if (usec < prev_usec)
+			wraps += 4294967296.0;
+		prev_usec = usec;
+
+		if (sscanf(tok[3] + 2, ":%d:%d:%d", &bus, &addr, &ep) != 3) {
+			bus = 0;
+			if (sscanf(tok[3] + 2, ":%d:%d", &addr, &ep) != 2)
+				continue;
+		}
+
+		if (!strcmp(tok[2], "S") && !strncmp(tok[3], "Co", 2) &&
+		    n > 11 && !strcmp(tok[4], "s") &&
+		    strtoul(tok[5], NULL, 16) == 0x21 &&
+		    strtoul(tok[6], NULL, 16) == HID_REQ_SET_REPORT &&
+		    (strtoul(tok[7], NULL, 16) & 0xff) ==
+		    KEYCHRON_REPORT_ID_CMD && !strcmp(tok[11], "=")) {
+			request = true;
+			i = 12;
+		} else if (!strcmp(tok[2], "C") && !strncmp(tok[3], "Ii", 2) &&
+			   n > 7 && strtol(tok[4], NULL, 10) == 0 &&
+			   !strcmp(tok[6], "=")) {
+			request = false;
+			i = 7;
+		} else {
+			continue;
+		}
+
+		/* Data words of up to four bytes each */
+		len = 0;
+		for (; i < n; i++)
+			for (p = tok[i]; p[0] && p[1] &&
+			     len < KEYCHRON_REPORT_SIZE; p += 2)
+				sscanf(p, "%2hhx", &data[len++]);
+
+		if (!len || data[0] != (request ? KEYCHRON_REPORT_ID_CMD :
+						  KEYCHRON_REPORT_ID_RESP))
+			continue;
+		replay_event((wraps + usec) / 1e6, bus, addr, request, data,
+			     len);
+	}
+	return ferror(f) ? -EIO : 0;
+}
+
+static uint32_t get32(const uint8_t *p, bool swap)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return swap ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t get16(const uint8_t *p, bool swap)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return swap ? __builtin_bswap16(v) : v;
+}
+
+/*
+ * pcap with the usbmon packet header. Its fields are in the byte order
+ * of the capturing machine, taken to be that of the file.
+ */
+static int read_pcap(FILE *f, const uint8_t *hdr)
+{
+	uint8_t rec[16], pkt[65536];
+	uint32_t magic = get32(hdr, false);
+	bool swap = magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS;
+	bool ns = get32(hdr, swap) == PCAP_MAGIC_NS;
+	uint32_t linktype = get32(hdr + 20, swap);
+	uint32_t incl, cap, hdr_len;
+	const uint8_t *setup, *data;
+	bool request;
+
+	if (linktype == LINKTYPE_USB_LINUX)
+		hdr_len = 48;
+	else if (linktype == LINKTYPE_USB_LINUX_MMAPPED)
+		hdr_len = 64;
+	else {
+		fprintf(stderr, "not a usbmon capture (link type %u)\n",
+			linktype);
+		return -EINVAL;
+	}
+
+	while (fread(rec, sizeof(rec), 1, f) == 1) {
+		incl = get32(rec + 8, swap);
+		if (incl > sizeof(pkt) || fread(pkt, incl, 1, f) != 1)
+			return -EIO;
+		if (incl < hdr_len)
+			continue;
+
+		cap = get32(pkt + 36, swap);
+		if (cap > incl - hdr_len)
+			cap = incl - hdr_len;
+		/* flag_data is 0 when data follows */
+		if (!cap || pkt[15])
+			continue;
+		setup = pkt + 40;
+		data = pkt + hdr_len;
+
+		if (pkt[8] == 'S' && pkt[9] == USB_XFER_CONTROL &&
+		    pkt[10] == 0 && pkt[14] == 0 && setup[0] == 0x21 &&
+		    setup[1] == HID_REQ_SET_REPORT &&
+		    setup[2] == KEYCHRON_REPORT_ID_CMD &&
+		    data[0] == KEYCHRON_REPORT_ID_CMD)
+			request = true;
+		else if (pkt[8] == 'C' && pkt[9] == USB_XFER_INTERRUPT &&
+			 (pkt[10] & 0x80) && get32(pkt + 28, swap) == 0 &&
+			 data[0] == KEYCHRON_REPORT_ID_RESP)
+			request = false;
+		else
+			continue;
+
+		replay_event(get32(rec, swap) +
+			     get32(rec + 4, swap) / (ns ? 1e9 : 1e6),
+			     get16(pkt + 12, swap), pkt[11], request, data,
+			     cap);
+	}
+	return ferror(f) ? -EIO : 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-a bus:address] [capture]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t hdr[24];
+	uint32_t magic;
+	FILE *f = stdin;
+	int c, ret;
+
+	while ((c = getopt(argc, argv, "a:")) != -1) {
+		switch (c) {
+		case 'a':
+			if (sscanf(optarg, "%d:%d", &filter_bus,
+				   &filter_addr) != 2)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind > 1)
+		usage(argv[0]);
+
+	if (optind < argc) {
+		f = fopen(argv[optind], "rb");
+		if (!f) {
+			perror(argv[optind]);
+			return 1;
+		}
+	}
+
+	printf("# keychron-replay %s\n", optind < argc ? argv[optind] : "-");
+
+	/* The file type by its first bytes; text is read from the start */
+	c = getc(f);
+	ungetc(c, f);
+	if (c == 0xd4 || c == 0xa1 || c == 0x4d || c == 0x0a) {
+		if (fread(hdr, sizeof(hdr), 1, f) != 1) {
+			fprintf(stderr, "short pcap header\n");
+			return 1;
+		}
+		magic = get32(hdr, false);
+		if (magic == PCAPNG_MAGIC) {
+			fprintf(stderr, "pcapng: convert with editcap -F pcap\n");
+			return 1;
+		}
+		if (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS &&
+		    magic != __builtin_bswap32(PCAP_MAGIC) &&
+		    magic != __builtin_bswap32(PCAP_MAGIC_NS)) {
+			fprintf(stderr, "unknown capture format\n");
+			return 1;
+		}
+		ret = read_pcap(f, hdr);
+	} else {
+		ret = read_text(f);
+	}
+	if (ret) {
+		fprintf(stderr, "reading capture: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	fprintf(stderr, "requests: %d\nresponses: %d\nexpected: %d\nskipped: %d\n",
+		num_requests, num_responses, num_expected, num_skipped);
+	return num_requests ? 0 : 1;
+}
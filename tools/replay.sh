@@ -0,0 +1,127 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Replays a usbmon capture against the keychron_battery driver
+#
+# Converts the capture with tools/keychron-replay, plays its device side
+# back through tools/keychron-emu -r on dummy_hcd, and checks that the
+# driver sends the captured requests, in order and no more, and publishes
+# the battery levels the captured responses carried. Responses keep the
+# delay they had in the capture, so timeouts and late responses replay
+# as they happened. Polls are forced back to back through debugfs rather
+# than waiting out the poll interval.
+#
+# Prints the outcome as "key: value" lines and exits non-zero if the
+# replay doesn't match, so that captures of field incidents can be kept
+# and run as regression tests.
+#
+# Needs root, make tools, debugfs and a kernel with dummy_hcd and
+# raw_gadget, like bench.sh.
+#
+# Usage: replay.sh [-p wired|receiver] [-a bus:address] [-d udc_device]
+#                  capture
+
+set -u
+
+product=receiver
+addr=
+udc=dummy_udc.0
+
+usage() {
+	echo "Usage: $0 [-p wired|receiver] [-a bus:address] [-d udc_device] capture" >&2
+	exit 2
+}
+
+while getopts "p:a:d:" opt; do
+	case $opt in
+	p) product=$OPTARG ;;
+	a) addr=$OPTARG ;;
+	d) udc=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 1 ] || usage
+capture=$1
+
+tools=$(dirname "$0")
+debugfs=/sys/kernel/debug
+serial=REPLAY$$
+supply=keychron_mouse_$serial
+tmp=$(mktemp -d)
+emu_pid=
+
+if [ "$(id -u)" -ne 0 ]; then
+	echo "must run as root" >&2
+	exit 1
+fi
+if [ ! -x "$tools/keychron-emu" ] || [ ! -x "$tools/keychron-replay" ]; then
+	echo "tools not built, run make tools" >&2
+	exit 1
+fi
+
+cleanup() {
+	[ -n "$emu_pid" ] && kill "$emu_pid" 2>/dev/null
+	wait 2>/dev/null
+	echo 'module keychron_battery -p' > $debugfs/dynamic_debug/control 2>/dev/null
+	rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+"$tools/keychron-replay" ${addr:+-a "$addr"} "$capture" > "$tmp/script" || exit 1
+steps=$(grep -c '^request ' "$tmp/script")
+sed -n 's/^expect //p' "$tmp/script" | uniq > "$tmp/expected"
+
+modprobe dummy_hcd && modprobe raw_gadget && modprobe keychron_battery || exit 1
+
+# "battery: N%" is a debug message
+echo 'module keychron_battery +p' > $debugfs/dynamic_debug/control
+marker="keychron-replay: start $$"
+echo "$marker" > /dev/kmsg
+
+"$tools/keychron-emu" -p "$product" -S "$serial" -d "$udc" -r "$tmp/script" \
+	> "$tmp/emu.log" 2>&1 &
+emu_pid=$!
+
+for ((i = 0; i < 1000; i++)); do
+	[ -e "/sys/class/power_supply/$supply" ] && break
+	grep -q "replay done" "$tmp/emu.log" && break
+	sleep 0.01
+done
+
+# Every poll takes at least one step
+if [ -e "/sys/class/power_supply/$supply" ]; then
+	dir=$debugfs/keychron/$(basename "$(readlink -f "/sys/class/power_supply/$supply/device")")
+	for ((i = 0; i < steps; i++)); do
+		grep -q "replay done" "$tmp/emu.log" && break
+		echo 1 > "$dir/poll"
+	done
+fi
+
+kill "$emu_pid" 2>/dev/null
+wait "$emu_pid" 2>/dev/null
+emu_pid=
+
+# The level published at probe, then every change
+dmesg | sed -n "/$marker/,\$p" |
+	sed -n -e "s/.*Keychron mouse battery $supply: \([0-9]*\)%.*/\1/p" \
+	       -e "s/.* $supply: battery: \([0-9]*\)%.*/\1/p" | uniq > "$tmp/observed"
+
+mismatched=$(grep -c "replay step .* mismatch" "$tmp/emu.log")
+extra=$(grep -c "replay extra request" "$tmp/emu.log")
+finished=$(grep -c "replay done" "$tmp/emu.log")
+
+echo "steps: $steps"
+echo "mismatched: $mismatched"
+echo "extra: $extra"
+echo "completed: $finished"
+echo "expected: $(paste -sd, "$tmp/expected")"
+echo "published: $(paste -sd, "$tmp/observed")"
+
+if [ "$mismatched" -ne 0 ] || [ "$extra" -ne 0 ] || [ "$finished" -ne 1 ] ||
+   ! cmp -s "$tmp/expected" "$tmp/observed"; then
+	echo "result: FAIL"
+	grep replay "$tmp/emu.log" >&2
+	exit 1
+fi
+echo "result: PASS"